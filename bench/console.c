@@ -0,0 +1,196 @@
+//
+//  console.c
+//  mcmdd
+//
+//  Console path benchmark: runs many stand-in servers through
+//  server_start(), so their output goes through read_line(),
+//  process_line(), the rules, history and the log just as in the daemon,
+//  and reports throughput, CPU per million lines, peak RSS and how many
+//  allocations the daemon code made. Allocations are counted by linking
+//  with --wrap, so only calls from mcmdd's own code are seen.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "server.h"
+#include "history.h"
+#include "flood.h"
+#include "reader.h"
+
+// what the daemon's modules expect main.c to provide
+struct config_t *config;
+struct server_t **servers;
+int servers_sp;
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_strdup(s);
+}
+
+char *__wrap_strndup(const char *s, size_t n)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_strndup(s, n);
+}
+
+static void *run(void *ptr)
+{
+    server_start(ptr);
+    return NULL;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-c children] [-o log] [-m history KB] [-f lines/s] [-i backend]\n"
+            "       [-- standin options]\n"
+            "  -c  stand-in servers to run at once (default 10)\n"
+            "  -o  where the console log goes (default /dev/null)\n"
+            "  -m  history_memory per server in KB (default %d)\n"
+            "  -f  flood_lines per server, 0 for no limit (default 0)\n"
+            "  -i  io_backend: auto, io_uring, epoll or threads (default auto)\n"
+            "options after -- go to every " STANDIN_NAME ", see %s -h\n",
+            name, DEFAULT_HISTORY_MEMORY / 1024, STANDIN_PATH);
+    exit(1);
+}
+
+static double seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *log = "/dev/null", *backend = "auto";
+    char command[4096], id[32];
+    struct rlimit limit;
+    struct rusage usage_before, usage_after;
+    struct timespec begin, end;
+    unsigned long lines, allocs;
+    pthread_t *threads, reader;
+    double wall, cpu;
+    long history = 0, flood = 0;
+    int children = 10, c, i, len;
+    FILE *report;
+
+    while ((c = getopt(argc, argv, "c:o:m:f:i:h")) != -1) {
+        switch (c) {
+            case 'c': children = atoi(optarg); break;
+            case 'o': log = optarg; break;
+            case 'm': history = atol(optarg); break;
+            case 'f': flood = atol(optarg); break;
+            case 'i': backend = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (children < 1)
+        usage(argv[0]);
+    len = snprintf(command, sizeof(command), "%s", STANDIN_PATH);
+    for (i = optind; i < argc && len < sizeof(command); ++i)
+        len += snprintf(command + len, sizeof(command) - len, " %s", argv[i]);
+
+    // two pipes per child
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen(log, "w", stdout))
+        err(1, "Failed to open %s", log);
+
+    config = config_new();
+    servers = malloc(children * sizeof(struct server_t *));
+    threads = malloc(children * sizeof(pthread_t));
+    if (!servers || !threads)
+        err(1, "Failed to allocate memory");
+    for (i = 0; i < children; ++i) {
+        snprintf(id, sizeof(id), "bench%d", i);
+        servers[i] = server_new(".", command, id);
+        if (history > 0) {
+            history_free(servers[i]->history);
+            servers[i]->history = history_new(history * 1024);
+        }
+        if (flood > 0)
+            flood_init(servers[i], flood, 0, 0);
+    }
+    servers_sp = children;
+    if (reader_init(backend, children) != READER_THREADS
+        && pthread_create(&reader, NULL, reader_loop, NULL) != 0)
+        err(1, "pthread_create");
+
+    getrusage(RUSAGE_SELF, &usage_before);
+    allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (i = 0; i < children; ++i)
+        if (pthread_create(&threads[i], NULL, run, servers[i]) != 0)
+            err(1, "pthread_create");
+    for (i = 0; i < children; ++i)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &usage_after);
+    allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocs;
+    fflush(stdout);
+
+    for (lines = 0, i = 0; i < children; ++i) {
+        lines += history_next(servers[i]->history);
+        if (servers[i]->flood)
+            lines += servers[i]->flood->total_dropped_lines + servers[i]->flood->total_repeats;
+    }
+    wall = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    cpu = seconds(usage_after.ru_utime) - seconds(usage_before.ru_utime)
+        + seconds(usage_after.ru_stime) - seconds(usage_before.ru_stime);
+    // one line of key=value pairs, to keep next to a baseline
+    fprintf(report, "backend=%s children=%d lines=%lu seconds=%.3f lines_per_sec=%.0f cpu_sec=%.3f "
+            "cpu_sec_per_mline=%.3f peak_rss_kb=%ld allocs=%lu allocs_per_line=%.2f "
+            "ctx_switches=%ld\n",
+            reader_backend_name(), children, lines, wall, lines / wall, cpu, cpu * 1e6 / (lines ? lines : 1),
+            usage_after.ru_maxrss, allocs, (double) allocs / (lines ? lines : 1),
+            usage_after.ru_nvcsw + usage_after.ru_nivcsw - usage_before.ru_nvcsw - usage_before.ru_nivcsw);
+    fclose(report);
+
+    for (i = 0; i < children; ++i) {
+        flood_free(servers[i]);
+        server_free(servers[i]);
+    }
+    free(servers);
+    free(threads);
+    config_free(config);
+    return 0;
+}
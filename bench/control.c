@@ -0,0 +1,305 @@
+//
+//  control.c
+//  mcmdd
+//
+//  Control protocol load generator: opens sessions to a running mcmdd,
+//  logs in, and sends a weighted mix of commands for a while, counting
+//  each command's latency into the same histograms TRACE uses. With -R
+//  every command gets a fresh connection, which shows what a connection
+//  (and its thread in mcmdd) costs. -U goes through the Unix socket and
+//  logs in by uid, without a key.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <err.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "trace.h"
+
+#define MAX_MIX 32
+
+struct mix_t {
+    const char *command;
+    int weight;
+};
+
+struct session_t {
+    int fd;
+    char buf[65536];
+    size_t start, len;
+    unsigned long requests, errors;
+    unsigned seed;
+};
+
+static const char *host = "127.0.0.1", *port = "8361", *path, *server, *key;
+static struct mix_t mix[MAX_MIX];
+static int nmix, total_weight, reconnect;
+static volatile int running = 1;
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s -s server [-k key] [-H host] [-p port] [-U socket] [-c sessions]\n"
+            "       [-d seconds] [-R] [-m command[:weight]]...\n"
+            "  -U  connect to this Unix socket (@name for an abstract one) instead\n"
+            "  -c  concurrent sessions (default 10)\n"
+            "  -d  how long to run (default 10)\n"
+            "  -R  connect and log in again for every command\n"
+            "  -m  a command line to send, with its share of the mix; the default\n"
+            "      mix is STATUS:60, \"EXEC list:20\", LOG:10, KEEPALIVE:10\n", name);
+    exit(1);
+}
+
+// returns 0 on success with *line pointing into the session buffer
+static int read_line(struct session_t *session, char **line)
+{
+    char *nl;
+    ssize_t n;
+
+    for (;;) {
+        nl = memchr(session->buf + session->start, '\n', session->len - session->start);
+        if (nl) {
+            *nl = '\0';
+            *line = session->buf + session->start;
+            session->start = nl + 1 - session->buf;
+            return 0;
+        }
+        if (session->start > 0) {
+            memmove(session->buf, session->buf + session->start, session->len - session->start);
+            session->len -= session->start;
+            session->start = 0;
+        }
+        if (session->len == sizeof(session->buf))
+            session->len = 0;
+        n = recv(session->fd, session->buf + session->len, sizeof(session->buf) - session->len, 0);
+        if (n <= 0)
+            return -1;
+        session->len += n;
+    }
+}
+
+static int send_line(struct session_t *session, const char *text)
+{
+    char line[1024];
+    int len = snprintf(line, sizeof(line), "%s\n", text);
+    return send(session->fd, line, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// reads a reply: one line, or everything between "Send start" and "Send end"
+static int read_reply(struct session_t *session)
+{
+    char *line;
+    if (read_line(session, &line) < 0)
+        return -1;
+    if (strncmp(line, "ERR", 3) == 0)
+        return 1;
+    if (strcmp(line, "OK Send start.") != 0)
+        return 0;
+    do {
+        if (read_line(session, &line) < 0)
+            return -1;
+    } while (strcmp(line, "OK Send end.") != 0);
+    return 0;
+}
+
+static int connect_local(struct session_t *session)
+{
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+    if (path[0] == '@')
+        sun.sun_path[0] = '\0';
+    session->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (session->fd < 0)
+        return -1;
+    return connect(session->fd, (struct sockaddr *) &sun, path[0] == '@'
+                   ? offsetof(struct sockaddr_un, sun_path) + strlen(path) : sizeof(sun));
+}
+
+static int session_open(struct session_t *session)
+{
+    struct addrinfo hints, *res;
+    char login[1024], *line;
+    long long begin;
+    int rc, on = 1;
+
+    session->start = session->len = 0;
+    if (path) {
+        begin = trace_now();
+        rc = connect_local(session);
+    } else {
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, port, &hints, &res) != 0)
+            return -1;
+        begin = trace_now();
+        session->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        rc = session->fd < 0 ? -1 : connect(session->fd, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        // KEEPALIVE gets no reply, Nagle would hold the next command for its ACK
+        if (rc == 0)
+            setsockopt(session->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+    // the banner comes from the connection's own thread
+    if (rc < 0 || read_line(session, &line) < 0)
+        return -1;
+    trace_record("connect", NULL, begin);
+
+    begin = trace_now();
+    snprintf(login, sizeof(login), "SERVER %s", server);
+    if (send_line(session, login) < 0 || read_line(session, &line) < 0)
+        return -1;
+    // without a key the Unix socket logs us in by uid
+    if (key) {
+        snprintf(login, sizeof(login), "KEY %s", key);
+        if (send_line(session, login) < 0 || read_line(session, &line) < 0)
+            return -1;
+    }
+    if (strcmp(line, "OK Logged in.") != 0) {
+        warnx("Login refused: %s", line);
+        return -1;
+    }
+    trace_record("login", NULL, begin);
+    return 0;
+}
+
+static void session_close(struct session_t *session)
+{
+    if (session->fd >= 0)
+        close(session->fd);
+    session->fd = -1;
+}
+
+static const char *pick(struct session_t *session)
+{
+    int r = rand_r(&session->seed) % total_weight, i;
+    for (i = 0; i < nmix - 1 && r >= mix[i].weight; ++i)
+        r -= mix[i].weight;
+    return mix[i].command;
+}
+
+static void *run(void *ptr)
+{
+    struct session_t *session = ptr;
+    const char *command;
+    long long begin;
+    int rc;
+
+    session->fd = -1;
+    while (running) {
+        if (session->fd < 0 && session_open(session) < 0) {
+            session->errors++;
+            session_close(session);
+            usleep(100000);
+            continue;
+        }
+        command = pick(session);
+        begin = trace_now();
+        if (send_line(session, command) < 0) {
+            if (running)
+                session->errors++;
+            session_close(session);
+            continue;
+        }
+        // KEEPALIVE has no reply, so only the send is timed
+        rc = strcmp(command, "KEEPALIVE") == 0 ? 0 : read_reply(session);
+        if (rc < 0) {
+            // the shutdown() at the end cuts off replies that were on the way
+            if (running)
+                session->errors++;
+            session_close(session);
+            continue;
+        }
+        trace_record(command, NULL, begin);
+        session->requests++;
+        if (rc > 0)
+            session->errors++;
+        if (reconnect)
+            session_close(session);
+    }
+    session_close(session);
+    return NULL;
+}
+
+static void add_mix(char *spec)
+{
+    char *colon = strrchr(spec, ':');
+    if (nmix == MAX_MIX)
+        errx(1, "Too many commands in the mix");
+    mix[nmix].weight = 1;
+    if (colon) {
+        *colon = '\0';
+        mix[nmix].weight = atoi(colon + 1);
+    }
+    mix[nmix].command = spec;
+    if (mix[nmix].weight > 0)
+        total_weight += mix[nmix++].weight;
+}
+
+int main(int argc, char *argv[])
+{
+    static char defaults[][16] = { "STATUS:60", "EXEC list:20", "LOG:10", "KEEPALIVE:10" };
+    struct session_t *sessions;
+    pthread_t *threads;
+    unsigned long requests, errors;
+    int c, i, count = 10, duration = 10;
+
+    while ((c = getopt(argc, argv, "H:p:U:s:k:c:d:Rm:h")) != -1) {
+        switch (c) {
+            case 'H': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'U': path = optarg; break;
+            case 's': server = optarg; break;
+            case 'k': key = optarg; break;
+            case 'c': count = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'R': reconnect = 1; break;
+            case 'm': add_mix(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (!server || !(key || path) || count < 1 || duration < 1)
+        usage(argv[0]);
+    if (nmix == 0)
+        for (i = 0; i < sizeof(defaults) / sizeof(defaults[0]); ++i)
+            add_mix(defaults[i]);
+    signal(SIGPIPE, SIG_IGN);
+
+    sessions = calloc(count, sizeof(struct session_t));
+    threads = malloc(count * sizeof(pthread_t));
+    if (!sessions || !threads)
+        err(1, "Failed to allocate memory");
+    for (i = 0; i < count; ++i) {
+        sessions[i].seed = i + 1;
+        if (pthread_create(&threads[i], NULL, run, &sessions[i]) != 0)
+            err(1, "pthread_create");
+    }
+    sleep(duration);
+    running = 0;
+    for (requests = errors = 0, i = 0; i < count; ++i) {
+        // a session blocked on a reply that never comes is not waited for
+        shutdown(sessions[i].fd, SHUT_RDWR);
+        pthread_join(threads[i], NULL);
+        requests += sessions[i].requests;
+        errors += sessions[i].errors;
+    }
+    printf("sessions=%d seconds=%d requests=%lu requests_per_sec=%.0f errors=%lu\n",
+           count, duration, requests, (double) requests / duration, errors);
+    // name, count, p50, p90, p99, p99.9 and max in microseconds
+    fflush(stdout);
+    trace_report(STDOUT_FILENO);
+    free(sessions);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# usage: control.sh <mcmdd> <mcmdd-bench-control> <data dir>
+# runs the daemon on its stand-in servers and puts load on its control port
+set -e
+mcmdd="$1"
+bench="$2"
+dir="$3"
+
+"$mcmdd" -n -d "$dir" > "$dir/mcmdd.log" 2>&1 &
+pid=$!
+trap 'kill -INT $pid; wait $pid' EXIT
+# let the stand-ins print for a while, so LOG has history to send
+sleep 5
+
+"$bench" -p 18361 -s bench1 -k bench -c 10 -d 10
+"$bench" -p 18361 -s bench2 -k bench -c 100 -d 10
+"$bench" -p 18361 -s bench3 -k bench -c 10 -d 5 -R -m STATUS
+"$bench" -U @mcmdd-bench -s bench4 -c 10 -d 5 -R -m STATUS
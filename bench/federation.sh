@@ -0,0 +1,21 @@
+#!/bin/sh
+# usage: federation.sh <mcmdd> <mcmdd-bench-control> <data dir>
+# runs two nodes, a and b, and sends the same load for b's servers to b
+# itself and then to a, which forwards it
+set -e
+mcmdd="$1"
+bench="$2"
+dir="$3"
+
+"$mcmdd" -n -d "$dir/a" > "$dir/a/mcmdd.log" 2>&1 &
+a=$!
+"$mcmdd" -n -d "$dir/b" > "$dir/b/mcmdd.log" 2>&1 &
+b=$!
+trap 'kill -INT $a $b; wait $a $b || true' EXIT
+# for a to fetch b's servers, and for the stand-ins to fill their history
+sleep 5
+
+"$bench" -p 18382 -s b1 -k bench -c 10 -d 10 -m STATUS
+"$bench" -p 18381 -s b1 -k bench -c 10 -d 10 -m STATUS
+"$bench" -p 18382 -s b2 -k bench -c 10 -d 10
+"$bench" -p 18381 -s b2 -k bench -c 10 -d 10
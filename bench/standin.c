@@ -0,0 +1,166 @@
+//
+//  standin.c
+//  mcmdd
+//
+//  Stands in for a game server in benchmarks: prints console lines at a
+//  given rate, size and burst pattern, says "Done" after a delay, answers
+//  commands on stdin, and crashes or hangs when told to.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <err.h>
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-r lines/s] [-s bytes] [-n lines] [-b burst] [-d done ms]\n"
+            "       [-C crash ms] [-H hang ms]\n"
+            "  -r  lines per second, 0 for as fast as the pipe takes them (default 1000)\n"
+            "  -s  length of a line (default 80)\n"
+            "  -n  lines to print before exiting, 0 for no end (default 10000)\n"
+            "  -b  lines printed together in one burst (default 1)\n"
+            "  -d  milliseconds before printing \"Done\" (default 0)\n"
+            "  -C  exit with code 3 after this many milliseconds\n"
+            "  -H  stop printing and reading after this many milliseconds\n"
+            "stdin: \"stop\" exits, \"crash\" exits with code 3, \"hang\" hangs,\n"
+            "anything else is echoed back\n", name);
+    exit(1);
+}
+
+static void hang(void)
+{
+    for (;;)
+        pause();
+}
+
+// answers one line of stdin, returns 0 on end of file
+static int command(void)
+{
+    static char buf[1024];
+    static size_t len;
+    char *nl;
+    ssize_t n;
+
+    n = read(0, buf + len, sizeof(buf) - len - 1);
+    if (n <= 0)
+        return 0;
+    len += n;
+    buf[len] = '\0';
+    while ((nl = strchr(buf, '\n')) != NULL) {
+        *nl = '\0';
+        if (strcmp(buf, "stop") == 0) {
+            printf("Stopping server\n");
+            exit(0);
+        } else if (strcmp(buf, "crash") == 0) {
+            printf("Exception in server tick loop\n");
+            exit(3);
+        } else if (strcmp(buf, "hang") == 0) {
+            fflush(stdout);
+            hang();
+        }
+        printf("[00:00:00] [Server thread/INFO]: got %s\n", buf);
+        len -= nl + 1 - buf;
+        memmove(buf, nl + 1, len + 1);
+    }
+    if (len == sizeof(buf) - 1)
+        len = 0;
+    fflush(stdout);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    long rate = 1000, size = 80, total = 10000, burst = 1, done = 0, crash = -1, hang_at = -1;
+    long long begin, next, now;
+    unsigned long printed;
+    struct pollfd pfd;
+    char *line, *filler;
+    int c, i, len, stdin_open, timeout;
+
+    while ((c = getopt(argc, argv, "r:s:n:b:d:C:H:h")) != -1) {
+        switch (c) {
+            case 'r': rate = atol(optarg); break;
+            case 's': size = atol(optarg); break;
+            case 'n': total = atol(optarg); break;
+            case 'b': burst = atol(optarg); break;
+            case 'd': done = atol(optarg); break;
+            case 'C': crash = atol(optarg); break;
+            case 'H': hang_at = atol(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (size < 40)
+        size = 40;
+    if (burst < 1)
+        burst = 1;
+    line = malloc(size + 1);
+    filler = malloc(size + 1);
+    if (!line || !filler)
+        err(1, "malloc");
+    // some repetition and some variety, like a real console
+    for (i = 0; i < size; ++i)
+        filler[i] = "the quick brown fox jumps over the lazy dog "[i % 44];
+    filler[size] = '\0';
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+    signal(SIGPIPE, SIG_DFL);
+
+    printf("[00:00:00] [Server thread/INFO]: Starting minecraft server version standin\n");
+    fflush(stdout);
+    begin = now_us();
+    if (done > 0)
+        usleep(done * 1000);
+    printf("[00:00:00] [Server thread/INFO]: Done (%.3fs)! For help, type \"help\"\n", done / 1000.0);
+    fflush(stdout);
+
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+    stdin_open = 1;
+    printed = 0;
+    next = now_us();
+    while (total == 0 || printed < (unsigned long) total) {
+        now = now_us();
+        if (crash >= 0 && now - begin >= crash * 1000) {
+            printf("Exception in server tick loop\n");
+            fflush(stdout);
+            exit(3);
+        }
+        if (hang_at >= 0 && now - begin >= hang_at * 1000) {
+            fflush(stdout);
+            hang();
+        }
+        if (rate > 0 && now < next) {
+            timeout = (next - now + 999) / 1000;
+        } else {
+            for (i = 0; i < burst && (total == 0 || printed < (unsigned long) total); ++i) {
+                len = snprintf(line, size + 1, "[00:00:00] [Server thread/INFO]: Player%lu moved %lu ",
+                               printed % 50, printed);
+                if (len < size)
+                    memcpy(line + len, filler, size - len);
+                line[size] = '\0';
+                puts(line);
+                printed++;
+            }
+            fflush(stdout);
+            if (rate > 0)
+                next += burst * 1000000LL / rate;
+            timeout = 0;
+        }
+        if (stdin_open && poll(&pfd, 1, timeout) > 0)
+            stdin_open = command();
+        else if (!stdin_open && timeout > 0)
+            usleep(timeout * 1000);
+    }
+    return 0;
+}
@@ -0,0 +1,224 @@
+//
+//  cds.c
+//  mcmdd
+//
+//  Most of a JVM's startup goes to loading and verifying the same classes
+//  every time. With cds=1, the first start of a server runs with
+//  -XX:ArchiveClassesAtExit, so the JVM dumps the classes it loaded into
+//  an archive in the server's directory when it stops. Later starts map
+//  that archive with -XX:SharedArchiveFile. The archive is only good for
+//  the jar and command line it was made with, so a CRC of both is kept
+//  next to it; when either changes, or the JVM complains about the
+//  archive, the next start makes a new one. How long each start takes
+//  to print "Done" is kept separately for starts with and without it.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "cds.h"
+
+void cds_init(struct server_t *server, const char *archive)
+{
+    struct cds_t *cds;
+    const char *name;
+
+    // the option goes right after the command, so that has to be the JVM
+    // and not a script or screen that starts it
+    name = server->argv[0] ? strrchr(server->argv[0], '/') : NULL;
+    name = name ? name + 1 : server->argv[0];
+    if (!name || strcmp(name, "java") != 0) {
+        warnx("[%s] cds needs the command to start with java, not %s; class data sharing is off",
+              server->id, name ? name : "nothing");
+        return;
+    }
+    cds = calloc(1, sizeof(struct cds_t));
+    if (!cds)
+        err(1, "Failed to allocate memory");
+    cds->archive = strdup(archive);
+    if (!cds->archive)
+        err(1, "Failed to allocate memory");
+    server->cds = cds;
+}
+
+// a file in the server's directory, as the daemon sees it
+static void server_file(const struct server_t *server, const char *name, char *out, size_t size)
+{
+    if (name[0] == '/' || !server->path[0])
+        snprintf(out, size, "%s", name);
+    else
+        snprintf(out, size, "%s/%s", server->path, name);
+}
+
+static unsigned long hash_file(const char *path, unsigned long crc)
+{
+    unsigned char buf[65536];
+    ssize_t n;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return crc;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        crc = crc32(crc, buf, n);
+    close(fd);
+    return crc;
+}
+
+// CRC of the command line and the jar it runs, if there is one
+static unsigned long hash_command(const struct server_t *server)
+{
+    char path[4096];
+    unsigned long crc = crc32(0, NULL, 0);
+    int i;
+
+    for (i = 0; server->argv[i]; ++i) {
+        crc = crc32(crc, (const unsigned char *) server->argv[i], strlen(server->argv[i]) + 1);
+        if (strcmp(server->argv[i], "-jar") == 0 && server->argv[i + 1]) {
+            server_file(server, server->argv[i + 1], path, sizeof(path));
+            crc = hash_file(path, crc);
+        }
+    }
+    return crc;
+}
+
+static int read_hash(const char *path, unsigned long *hash)
+{
+    FILE *file = fopen(path, "r");
+    int ok;
+    if (!file)
+        return -1;
+    ok = fscanf(file, "%lx", hash) == 1;
+    fclose(file);
+    return ok ? 0 : -1;
+}
+
+/*!
+ * The command line to start the server with this time, with the option
+ * that maps the archive, or the one that writes it, after the java
+ * command. Stays valid until the next call.
+ */
+char *const *cds_argv(struct server_t *server)
+{
+    struct cds_t *cds = server->cds;
+    char archive[4096], hash_path[sizeof(archive) + 5], option[4200];
+    unsigned long stored;
+    struct stat st;
+    int argc, i;
+
+    if (!server->argv[0])
+        return server->argv;
+    server_file(server, cds->archive, archive, sizeof(archive));
+    snprintf(hash_path, sizeof(hash_path), "%s.hash", archive);
+    cds->hash = hash_command(server);
+    if (!cds->rejected && stat(archive, &st) == 0 && read_hash(hash_path, &stored) == 0
+        && stored == cds->hash) {
+        cds->mode = CDS_USE;
+        snprintf(option, sizeof(option), "-XX:SharedArchiveFile=%s", cds->archive);
+    } else {
+        // an old archive must not pass for the new one if this run doesn't finish it
+        unlink(hash_path);
+        unlink(archive);
+        cds->mode = CDS_DUMP;
+        cds->rejected = 0;
+        snprintf(option, sizeof(option), "-XX:ArchiveClassesAtExit=%s", cds->archive);
+    }
+    time(&cds->run_start);
+
+    if (cds->argv)
+        server_free_argv(cds->argv);
+    for (argc = 0; server->argv[argc]; ++argc)
+        ;
+    cds->argv = malloc((argc + 2) * sizeof(char *));
+    if (!cds->argv)
+        err(1, "Failed to allocate memory");
+    for (i = 0; i <= argc; ++i) {
+        cds->argv[i] = strdup(i == 0 ? server->argv[0] : i == 1 ? option : server->argv[i - 1]);
+        if (!cds->argv[i])
+            err(1, "Failed to allocate memory");
+    }
+    cds->argv[argc + 1] = NULL;
+    printf("[%s] %s class data archive %s\n", server->id,
+           cds->mode == CDS_USE ? "Using" : "Making", cds->archive);
+    return cds->argv;
+}
+
+/*!
+ * Watches the startup output for the JVM turning the archive down, e.g.
+ * after a Java update.
+ */
+void cds_line(struct server_t *server, const char *line)
+{
+    struct cds_t *cds = server->cds;
+    if (cds->mode != CDS_USE || server->status != STATUS_STARTING || cds->rejected)
+        return;
+    if (strstr(line, "shared archive file") || (strstr(line, "[cds]") && strstr(line, "warning"))) {
+        printf("[%s] Class data archive rejected, making a new one next start\n", server->id);
+        cds->rejected = 1;
+    }
+}
+
+/*!
+ * @param ms from spawning until "Done"
+ */
+void cds_started(struct server_t *server, long long ms)
+{
+    struct cds_t *cds = server->cds;
+    int with = cds->mode == CDS_USE;
+
+    if (cds->mode == CDS_NONE)
+        return;
+    cds->runs[with]++;
+    cds->total_ms[with] += ms;
+    cds->last_ms[with] = ms;
+    if (cds->runs[!with])
+        printf("[%s] Started in %lld ms %s class data archive (%lld ms %s)\n", server->id, ms,
+               with ? "with" : "without", cds->total_ms[!with] / (long long) cds->runs[!with],
+               with ? "without" : "with");
+}
+
+/*!
+ * After the JVM is gone: an archive it wrote on the way out is now good
+ * for this jar and command line.
+ */
+void cds_exited(struct server_t *server)
+{
+    struct cds_t *cds = server->cds;
+    char archive[4096], hash_path[sizeof(archive) + 5];
+    struct stat st;
+    FILE *file;
+
+    if (cds->mode != CDS_DUMP)
+        return;
+    server_file(server, cds->archive, archive, sizeof(archive));
+    snprintf(hash_path, sizeof(hash_path), "%s.hash", archive);
+    // a crashed or killed JVM doesn't write one
+    if (stat(archive, &st) < 0 || st.st_mtime < cds->run_start || st.st_size == 0)
+        return;
+    file = fopen(hash_path, "w");
+    if (!file) {
+        warn("[%s] Failed to write %s", server->id, hash_path);
+        return;
+    }
+    fprintf(file, "%lx\n", cds->hash);
+    fclose(file);
+    printf("[%s] Class data archive %s written, %lld KB\n", server->id, cds->archive,
+           (long long) st.st_size / 1024);
+}
+
+void cds_free(struct server_t *server)
+{
+    if (!server->cds)
+        return;
+    if (server->cds->argv)
+        server_free_argv(server->cds->argv);
+    free(server->cds->archive);
+    free(server->cds);
+    server->cds = NULL;
+}
@@ -0,0 +1,48 @@
+//
+//  cds.h
+//  mcmdd
+//
+//  A class data sharing archive per server, made and used by mcmdd.
+//
+
+#ifndef mcmdd_cds_h
+#define mcmdd_cds_h
+
+#include <time.h>
+
+#include "server.h"
+
+#define DEFAULT_CDS_ARCHIVE "mcmdd.jsa"
+
+enum cds_mode_t {
+    // not started by this daemon yet
+    CDS_NONE = 0,
+    // this run writes the archive when the JVM exits
+    CDS_DUMP,
+    // this run maps the archive
+    CDS_USE
+};
+
+struct cds_t {
+    // relative to the server's path, as the JVM runs there
+    char *archive;
+    enum cds_mode_t mode;
+    // jar and command line the archive is made for
+    unsigned long hash;
+    time_t run_start;
+    // the JVM turned the archive down, so make a new one next time
+    int rejected;
+    // starts and milliseconds until "Done", without [0] and with [1] the archive
+    unsigned long runs[2];
+    long long total_ms[2], last_ms[2];
+    char **argv;
+};
+
+void cds_init(struct server_t *server, const char *archive);
+char *const *cds_argv(struct server_t *server);
+void cds_line(struct server_t *server, const char *line);
+void cds_started(struct server_t *server, long long ms);
+void cds_exited(struct server_t *server);
+void cds_free(struct server_t *server);
+
+#endif
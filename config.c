@@ -76,6 +76,26 @@ const char *config_get(struct config_t *config, const char *section, const char
     return default_value;
 }
 
+const char *config_next(struct config_t *config, const char *section, const char *prefix, int *iter)
+{
+    int i;
+    for (i = *iter; i < config->len; ++i) {
+        const char *lkey = config->keys[i], *lsec = config->sections[i];
+        if (section && !lsec)
+            continue;
+        if (!section && lsec)
+            continue;
+        if (section && strcmp(section, lsec) != 0)
+            continue;
+        if (strncmp(prefix, lkey, strlen(prefix)) == 0) {
+            *iter = i + 1;
+            return config->values[i];
+        }
+    }
+    *iter = i;
+    return NULL;
+}
+
 enum config_state_t {
     STATE_KEY = 0, // first part of a config option
     STATE_VAL, // second part, the value
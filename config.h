@@ -24,10 +24,17 @@ struct config_t {
 #define MAX_WAIT 60
 #define BACKUP_DIRECTORY "backups"
 #define BACKUP_DATE "%Y-%m-%d_%H-%M-%S"
+#define WATCHDOG_DIRECTORY "hangs"
 
 struct config_t *config_new(void);
 int config_load(struct config_t *config, FILE *file);
 const char *config_get(struct config_t *config, const char *section, const char *key, const char *default_value);
+/*!
+ * Walks every value in a section whose key starts with prefix, for options
+ * that may be given more than once. iter starts at 0.
+ * @return the next value, or NULL when there are no more
+ */
+const char *config_next(struct config_t *config, const char *section, const char *prefix, int *iter);
 void config_free(struct config_t *config);
 
 #endif
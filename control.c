@@ -6,88 +6,286 @@
 //  Copyright (c) 2014 Connor Monahan. All rights reserved.
 //
 
+// struct ucred
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 #include <poll.h>
-//#include <sys/un.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <err.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
 #include "config.h"
 #include "server.h"
+#include "spare.h"
+#include "rules.h"
+#include "telemetry.h"
+#include "watchdog.h"
+#include "placement.h"
+#include "memory.h"
+#include "handover.h"
+#include "flood.h"
+#include "history.h"
+#include "trace.h"
+#include "events.h"
+#include "cds.h"
+#include "peers.h"
 
 static struct sockaddr_in sin;
-//static struct sockaddr_un sun;
-static int listener;
+static struct sockaddr_un sun;
+static int listener, local = -1;
 extern struct config_t *config;
+extern struct server_t **servers;
+extern int servers_sp;
 
 struct server_t *get_server(const char *id);
 
+/*!
+ * The Unix socket from the "socket" setting, a path or @name for the
+ * abstract namespace. Local tools can log in on it by uid or gid instead
+ * of with a key.
+ */
+static void control_init_local()
+{
+    const char *path = config_get(config, NULL, "socket", "");
+    socklen_t len;
+
+    if (strlen(path) < 1)
+        return;
+    if (strlen(path) >= sizeof(sun.sun_path))
+        errx(1, "Unix socket path too long: %s", path);
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    if (path[0] == '@') {
+        sun.sun_path[0] = '\0';
+        len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    } else {
+        unlink(sun.sun_path);
+        len = sizeof(sun);
+    }
+
+    local = socket(AF_UNIX, SOCK_STREAM, 0);
+    fcntl(local, F_SETFD, FD_CLOEXEC);
+    if (bind(local, (struct sockaddr *) &sun, len) < 0)
+        err(1, "bind to Unix socket");
+    // anyone may connect, like on the TCP port; logging in is what's checked
+    if (path[0] != '@')
+        chmod(sun.sun_path, 0666);
+    if (listen(local, SOMAXCONN) < 0)
+        err(1, "listen");
+}
+
 void control_init()
 {
+    int on = 1;
+
     sin.sin_family = AF_INET;
     sin.sin_addr.s_addr = INADDR_ANY;
     sin.sin_port = htons(atoi(config_get(config, NULL, "port", "8361")));
     
-//    sun.sun_family = AF_UNIX;
-//    strcpy(sun.sun_path, "mcmdd.sock");
-//    unlink(sun.sun_path);
-    
     listener = socket(AF_INET, SOCK_STREAM, 0);
+    // servers must not inherit the control port, only a handover passes it on
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    // connections from other nodes are still open when we stop, and the
+    // port stays in TIME_WAIT after we close them
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
     
     if (bind(listener, (struct sockaddr *) &sin, sizeof(sin)) < 0)
         err(1, "bind to IP socket");
     
-//    if (bind(listener, (struct sockaddr *) &sun, sizeof(sin)) < 0)
-//        err(1, "bind to Unix socket");
-//    
-    if (listen(listener, 5) < 0)
+    if (listen(listener, SOMAXCONN) < 0)
         err(1, "listen");
+    control_init_local();
 }
 
 /*!
+ * @param local_fd the Unix socket, or -1 to open it from the config
+ */
+void control_adopt(int fd, int local_fd)
+{
+    socklen_t len;
+
+    listener = fd;
+    fcntl(listener, F_SETFD, FD_CLOEXEC);
+    if (local_fd >= 0) {
+        local = local_fd;
+        fcntl(local, F_SETFD, FD_CLOEXEC);
+        // for control_stop() to unlink a filesystem socket
+        len = sizeof(sun);
+        if (getsockname(local, (struct sockaddr *) &sun, &len) < 0)
+            memset(&sun, 0, sizeof(sun));
+    } else {
+        control_init_local();
+    }
+}
+
+int control_listener(void)
+{
+    return listener;
+}
+
+int control_local_listener(void)
+{
+    return local;
+}
+
+struct line_reader_t {
+    int fd;
+    int start, len;
+    char buf[1024];
+};
+
+/*!
+ * Reads a whole packet at a time and hands out the lines in it.
  * @return number of bytes read, or status. Returns -1 on overflow
- *   or 0 on end of file.
+ *   or end of file, or -2 when nothing came for 10 seconds.
  */
-static int read_line(char *out, int fd, int max)
+static int read_line(char *out, struct line_reader_t *in, int max)
 {
+    char *line, *nl;
     int bytes, status;
-    char ch;
-    struct pollfd pfd;
-    
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-    bytes = 0;
-    status = 1;
-    while (status > 0) {
-        status = poll(&pfd, 1, 10000);
-        if (status == 0)
-            return -2;
-        else if (status == -1 && errno == EINTR)
-            continue; // interrupted sys call
-        else if (status == -1)
-            err(1, "read_line poll");
-        status = recv(fd, &ch, 1, 0);
-        if (status == 0)
-            return -1;
-        else if (status == -1)
-            err(1, "read_line recv");
-        
-        if (bytes >= max)
-            return -1;
-        if (ch == '\n') {
+
+    while (1) {
+        line = in->buf + in->start;
+        nl = memchr(line, '\n', in->len - in->start);
+        if (nl) {
+            bytes = nl - line;
+            in->start += bytes + 1;
+            if (bytes >= max)
+                return -1;
+            memcpy(out, line, bytes);
             out[bytes] = '\0';
             return bytes;
-        } else {
-            out[bytes++] = ch;
         }
+        if (in->len - in->start >= max)
+            return -1;
+        memmove(in->buf, line, in->len - in->start);
+        in->len -= in->start;
+        in->start = 0;
+        // SO_RCVTIMEO makes an idle client time out here
+        status = recv(in->fd, in->buf + in->len, sizeof(in->buf) - in->len, 0);
+        if (status == -1 && errno == EINTR)
+            continue;
+        else if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -2;
+        else if (status <= 0)
+            // a client that hangs up on unread data resets the connection
+            return -1;
+        in->len += status;
     }
+}
+
+/*!
+ * Daemon-wide commands need one of the keys in the global auth list.
+ */
+static int valid_global(const char *key)
+{
+    char *token, *string, *tofree;
+    int valid;
+
+    if (!key || strlen(key) < 1)
+        return 0;
+    tofree = string = strdup(config_get(config, NULL, "auth", ""));
+    if (!string)
+        err(1, "strdup");
+    valid = 0;
+    while ((token = strsep(&string, " ")) != NULL)
+        if (strcmp(key, token) == 0)
+            valid = 1;
+    free(tofree);
+    return valid;
+}
+
+/*!
+ * The uid and gid of the process at the other end of a Unix socket.
+ * @return 0, or -1 if fd is not a Unix socket
+ */
+static int peer_ids(int fd, uid_t *uid, gid_t *gid)
+{
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+
+    if (getsockname(fd, (struct sockaddr *) &ss, &slen) < 0 || ss.ss_family != AF_UNIX)
+        return -1;
+#ifdef __linux__
+    struct ucred cred;
+    slen = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &slen) < 0)
+        return -1;
+    *uid = cred.uid;
+    *gid = cred.gid;
     return 0;
+#else
+    return getpeereid(fd, uid, gid);
+#endif
+}
+
+// whether a space-separated list of ids or names holds id
+static int id_listed(const char *list, long id, int group)
+{
+    char *token, *string, *tofree, buf[16384];
+    struct passwd pwd, *pw;
+    struct group grp, *gr;
+    int found;
+
+    tofree = string = strdup(list);
+    if (!string)
+        err(1, "strdup");
+    found = 0;
+    while (!found && (token = strsep(&string, " ")) != NULL) {
+        if (strlen(token) < 1)
+            continue;
+        if (isdigit((unsigned char) token[0])) {
+            found = atol(token) == id;
+        } else if (group) {
+            found = getgrnam_r(token, &grp, buf, sizeof(buf), &gr) == 0 && gr && gr->gr_gid == id;
+        } else {
+            found = getpwnam_r(token, &pwd, buf, sizeof(buf), &pw) == 0 && pw && pw->pw_uid == id;
+        }
+    }
+    free(tofree);
+    return found;
+}
+
+/*!
+ * Whether a local peer may log in to server without a key, by the
+ * allow_uid and allow_gid lists of the server or else the global ones.
+ * With no server, only the global lists count, as for valid_global().
+ */
+static int valid_peer(uid_t uid, gid_t gid, const char *server)
+{
+    const char *uids, *gids;
+
+    if (server && (strlen(server) < 1
+                   || strstr(config_get(config, NULL, "servers", ""), server) == NULL))
+        return 0;
+    uids = config_get(config, NULL, "allow_uid", "");
+    gids = config_get(config, NULL, "allow_gid", "");
+    if (server) {
+        uids = config_get(config, server, "allow_uid", uids);
+        gids = config_get(config, server, "allow_gid", gids);
+    }
+    return id_listed(uids, uid, 0) || id_listed(gids, gid, 1);
 }
 
 int valid(const char *key, const char *server)
@@ -121,105 +319,532 @@ int valid(const char *key, const char *server)
 #define OKKEY "OK Logged in.\n"
 #define INTERR "ERR Internal error.\n"
 #define OKEXEC "OK Command sent.\n"
-#define STATF "OK Stats %d %.f\n"
+#define STATF "OK Stats %d %.f %d %.f\n"
 #define EOFF "ERR Server is off.\n"
+#define QFULL "ERR Input queue full.\n"
+#define BADRANGE "ERR Bad time range.\n"
 #define TSTART "OK Send start.\n"
 #define TEND "OK Send end.\n"
+#define SPAREF "OK Spare %d %d %d %lld\n"
+#define NOSPARE "ERR Hot spare disabled.\n"
+#define WATCHF "OK Watchdog %d %d %d\n"
+#define NOWATCH "ERR Watchdog disabled.\n"
+#define PLACEF "OK Placement %s\n"
+#define UPGRADING "OK Upgrading.\n"
+#define MEMF "OK Memory %ld %.1f %.f %d\n"
+#define NOMEM "ERR Memory restarts disabled.\n"
+#define FLOODF "OK Flood %lu %lu %lu %lu %lu\n"
+#define NOFLOOD "ERR Flood control disabled.\n"
+#define CDSF "OK Cds %s %lu %lld %lu %lld\n"
+#define NOCDS "ERR Class data sharing disabled.\n"
+#define NODEF "OK Node %s\n"
+#define NONODE "ERR Node unreachable.\n"
+#define NOTHERE "ERR Not on this node.\n"
+#define FORWARDF "OK Forward %lld\n"
 
 static inline void qwrite(int fd, const char *message)
 {
     write(fd, message, strlen(message));
 }
 
+static inline void send_rules(int fd, struct server_t *server)
+{
+    struct rules_t *rules = server->rules;
+    char msg[SERVER_LINEMAX + 64];
+    int i;
+
+    qwrite(fd, TSTART);
+    for (i = 0; i < rules->len; ++i) {
+        // hits, action, then the pattern which may contain spaces
+        snprintf(msg, sizeof(msg), "%ld %s %s\n", rules->rules[i].hits,
+                 rules_action_name(rules->rules[i].action), rules->rules[i].pattern);
+        qwrite(fd, msg);
+    }
+    qwrite(fd, TEND);
+}
+
+struct log_writer {
+    int fd;
+    size_t len;
+    char buf[16384];
+    // stop after lines stamped later than this, for LOG RANGE
+    long long until;
+};
+
+static void write_log_text(struct log_writer *out, const char *text, size_t len)
+{
+    if (out->len + len > sizeof(out->buf)) {
+        write(out->fd, out->buf, out->len);
+        out->len = 0;
+    }
+    memcpy(out->buf + out->len, text, len);
+    out->len += len;
+}
+
+static int write_log_line(void *ctx, const struct history_line_t *line)
+{
+    write_log_text(ctx, line->text, strlen(line->text));
+    write_log_text(ctx, "\n", 1);
+    return 0;
+}
+
+// sequence number, wall clock seconds with milliseconds, then the line
+static int write_stamped_line(void *ctx, const struct history_line_t *line)
+{
+    struct log_writer *out = ctx;
+    char head[48];
+    int len;
+
+    if (line->stamp.mono > out->until)
+        return 1;
+    len = snprintf(head, sizeof(head), "%lu %lld.%03lld ", line->seq,
+                   line->stamp.wall / 1000000, line->stamp.wall / 1000 % 1000);
+    write_log_text(out, head, len);
+    return write_log_line(ctx, line);
+}
+
+struct log_start {
+    const char *line;
+    unsigned long seq;
+    int found;
+};
+
+static int find_start_line(void *ctx, const struct history_line_t *line)
+{
+    struct log_start *start = ctx;
+    if (strstr(start->line, line->text) == start->line) {
+        start->seq = line->seq;
+        start->found = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*!
+ * GREP <word> [limit] [since], or GREP "<pattern>" [limit] [since] for
+ * a pattern with spaces. Sends sequence number, time and line of each match.
+ */
+static inline void send_grep(int fd, struct server_t *server, char *args)
+{
+    struct log_writer out;
+    char *pattern, *rest;
+    unsigned long since;
+    int limit;
+
+    if (*args == '"') {
+        pattern = args + 1;
+        rest = strchr(pattern, '"');
+    } else {
+        pattern = args;
+        rest = strchr(pattern, ' ');
+    }
+    if (rest)
+        *rest++ = '\0';
+    limit = 100;
+    since = 0;
+    if (rest)
+        sscanf(rest, "%d %lu", &limit, &since);
+    out.fd = fd;
+    out.len = 0;
+    out.until = LLONG_MAX;
+    qwrite(fd, TSTART);
+    history_grep(server->history, pattern, since, limit, write_stamped_line, &out);
+    write(fd, out.buf, out.len);
+    qwrite(fd, TEND);
+}
+
+/*!
+ * Reads a time as Unix seconds, as HH:MM[:SS] within the last day, or "now".
+ * @return 0, or -1 if it is none of those
+ */
+static int parse_time(const char *arg, const struct history_stamp_t *now, long long *wall)
+{
+    struct tm tm;
+    time_t t;
+    double secs;
+    int h, m, sec = 0;
+    char end;
+
+    if (strcmp(arg, "now") == 0) {
+        *wall = now->wall;
+    } else if (strchr(arg, ':')) {
+        if (sscanf(arg, "%d:%d:%d", &h, &m, &sec) < 2)
+            return -1;
+        t = now->wall / 1000000;
+        localtime_r(&t, &tm);
+        tm.tm_hour = h;
+        tm.tm_min = m;
+        tm.tm_sec = sec;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+        if (t > now->wall / 1000000)
+            t -= 24 * 60 * 60;
+        *wall = t * 1000000LL;
+    } else if (sscanf(arg, "%lf%c", &secs, &end) == 1) {
+        *wall = (long long) (secs * 1000000);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * LOG RANGE <from> <to>. The wall clock times are turned into monotonic
+ * ones at the current offset, so a clock step in between doesn't unsort
+ * the history, and both ends are then found by binary search.
+ */
+static inline void send_range(int fd, struct server_t *server, const char *args)
+{
+    struct history_stamp_t now;
+    struct log_writer out;
+    char from[32], to[32];
+    long long begin, end;
+
+    history_now(&now);
+    if (sscanf(args, "%31s %31s", from, to) != 2 || parse_time(from, &now, &begin) < 0
+        || parse_time(to, &now, &end) < 0) {
+        qwrite(fd, BADRANGE);
+        return;
+    }
+    out.fd = fd;
+    out.len = 0;
+    out.until = end - now.wall + now.mono;
+    qwrite(fd, TSTART);
+    history_each(server->history, history_seek(server->history, begin - now.wall + now.mono),
+                 write_stamped_line, &out);
+    write(fd, out.buf, out.len);
+    qwrite(fd, TEND);
+}
+
 static inline void send_log(int fd, struct server_t *server, const char *start_line)
 {
-    int sp, bufsp, found_line;
-    char buf[(SERVER_LINEMAX + 2) * SERVER_MAXLINES];
+    struct log_writer out;
+    unsigned long from;
 
-    bufsp = 0;
-    found_line = 0;
+    from = 0;
+    if (start_line) {
+        // only send what came after the client's last line, if we still have it
+        struct log_start start = { start_line, 0, 0 };
+        history_each(server->history, 0, find_start_line, &start);
+        if (start.found)
+            from = start.seq + 1;
+    }
+    out.fd = fd;
+    out.len = 0;
+    out.until = LLONG_MAX;
     qwrite(fd, TSTART);
-    if (server->lines[server->linsp]) {
-        // means data has been overwritten, so start reading from linsp forward
-        for (sp = server->linsp; sp < SERVER_MAXLINES; ++sp) {
-            // add line to buffer at current position
-            sprintf(buf + bufsp, "%s\n", server->lines[sp]);
-            // buffer is written into like one giant block
-            bufsp += strlen(server->lines[sp]) + 1; // +1 to overwrite the last \0
-            if (start_line && !found_line && strstr(start_line, server->lines[sp]) == start_line) {
-                found_line = 1;
-                bufsp = 0;
-            }
+    history_each(server->history, from, write_log_line, &out);
+    write(fd, out.buf, out.len);
+    qwrite(fd, TEND);
+}
+
+/*!
+ * Streams events as "seq time server type [detail]" lines until the
+ * client sends a line or hangs up. Only the logged in server's events are
+ * sent, unless all is set.
+ * @param after the last sequence number the client has seen
+ */
+static void send_watch(struct line_reader_t *in, struct server_t *server, int all,
+                       unsigned long after)
+{
+    int fd = in->fd;
+    struct pollfd pfd;
+    struct event_t event;
+    char msg[EVENT_DETAILMAX + 256], line[256];
+    int len;
+
+    // numbers go on across an upgrade but start over with a new daemon, so
+    // a number from an earlier one is too far ahead and all since is new
+    if (after > events_last())
+        after = 0;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    qwrite(fd, TSTART);
+    for (;;) {
+        if (events_next(&after, &event, 1000)
+            && (all || !event.server || event.server == server->id)) {
+            len = snprintf(msg, sizeof(msg), "%lu %lld.%03lld %s %s%s%s\n", event.seq,
+                           event.time / 1000, event.time % 1000,
+                           event.server ? event.server : "-", event.type,
+                           event.detail[0] ? " " : "", event.detail);
+            if (send(fd, msg, len, MSG_NOSIGNAL) < 0)
+                return;
         }
+        if (in->start < in->len || poll(&pfd, 1, 0) != 0)
+            break;
     }
-    for (sp = 0; sp < server->linsp; ++sp) {
-        sprintf(buf + bufsp, "%s\n", server->lines[sp]);
-        bufsp += strlen(server->lines[sp]) + 1;
-        if (start_line && !found_line && strstr(start_line, server->lines[sp]) == start_line) {
-            found_line = 1;
-            bufsp = 0;
-        }
+    // the line that ended the stream is not a command
+    if (read_line(line, in, sizeof(line)) < 0)
+        return;
+    qwrite(fd, TEND);
+}
+
+static const char *commands[] = {
+    "SERVER", "KEY", "EXEC", "KILL", "STOP", "RESTART", "START", "STATUS", "LOG", "GREP",
+    "RULES", "PERF", "WATCHDOG", "PLACEMENT", "MEMORY", "FLOOD", "CDS", "SPARE", "UPGRADE",
+    "TRACE", "WATCH", "KEEPALIVE", "PEER", "FORWARD", "INVENTORY", "NODES", NULL
+};
+
+// what a client logged in to a server on another node can have sent there
+static const char *forwarded[] = {
+    "EXEC", "KILL", "STOP", "RESTART", "START", "STATUS", "LOG", "GREP", "RULES", "PERF",
+    "WATCHDOG", "PLACEMENT", "MEMORY", "FLOOD", "CDS", "SPARE", NULL
+};
+
+// histogram name for a command line, from a fixed set so clients can't add more
+static const char *command_name(const char *line)
+{
+    size_t len = strcspn(line, " ");
+    int i;
+    for (i = 0; commands[i]; ++i)
+        if (strlen(commands[i]) == len && strncmp(line, commands[i], len) == 0)
+            return commands[i];
+    return "INVALID";
+}
+
+static int forwards(const char *line)
+{
+    const char *name = command_name(line);
+    int i;
+    for (i = 0; forwarded[i]; ++i)
+        if (strcmp(name, forwarded[i]) == 0)
+            return 1;
+    return 0;
+}
+
+// the id and status of each of our servers, for the other nodes
+static void send_inventory(int fd)
+{
+    char msg[256];
+    int i;
+
+    qwrite(fd, TSTART);
+    for (i = 0; i < servers_sp; ++i) {
+        snprintf(msg, sizeof(msg), "%s %d\n", servers[i]->id, servers[i]->status);
+        qwrite(fd, msg);
+    }
+    qwrite(fd, TEND);
+}
+
+// server, node and status of every server in the federation
+static void send_nodes(int fd)
+{
+    char msg[256];
+    int i;
+
+    qwrite(fd, TSTART);
+    for (i = 0; i < servers_sp; ++i) {
+        snprintf(msg, sizeof(msg), "%s %s %d\n", servers[i]->id, peers_node(),
+                 servers[i]->status);
+        qwrite(fd, msg);
     }
-    // send the whole buffer
-    write(fd, buf, bufsp);
+    peers_list(fd);
     qwrite(fd, TEND);
 }
 
+// somewhere to hold a forwarded reply until its length is known
+static int spool_open(void)
+{
+    FILE *file;
+    int fd;
+
+#ifdef __linux__
+    fd = memfd_create("mcmdd-forward", MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+#endif
+    file = tmpfile();
+    if (!file)
+        return -1;
+    fd = dup(fileno(file));
+    fclose(file);
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/*!
+ * Sends a forwarded command's reply after its length, so the other node
+ * can tell where it ends whatever lines it holds, and the connection is
+ * ready for the next command right after.
+ */
+static void send_spool(int fd, int spool)
+{
+    char buf[16384];
+    off_t len;
+    ssize_t r;
+
+    len = lseek(spool, 0, SEEK_CUR);
+    snprintf(buf, sizeof(buf), FORWARDF, (long long) len);
+    qwrite(fd, buf);
+    lseek(spool, 0, SEEK_SET);
+    while (len > 0 && (r = read(spool, buf, sizeof(buf))) > 0) {
+        write(fd, buf, r);
+        len -= r;
+    }
+}
+
+/*!
+ * Logs in to a server on another node, which answers the client itself.
+ * @param nokey the reply while the client has sent no key yet
+ */
+static int remote_login(int fd, struct peer_t *remote, const char *server, const char *key,
+                        const char *nokey)
+{
+    int r;
+
+    if (!key) {
+        qwrite(fd, nokey);
+        return 0;
+    }
+    r = peers_forward(remote, server, key, "KEY", fd);
+    if (r < 0)
+        qwrite(fd, NONODE);
+    return r > 0;
+}
+
 void control_read(int fd)
 {
     qwrite(fd, APPNAME);
-    char tmp[256], msg[256];
-    char *key, *server;
+    char tmp[1024], msg[256];
+    char *key, *server, *fkey, *command;
     int vald;
     int ka;
     int r;
+    long long begin, phase;
     struct server_t *serv;
+    uid_t uid;
+    gid_t gid;
+    int peer, admin, on;
+    // fed: another node is logged in, remote: the server runs on that node
+    int fed;
+    // while a forwarded command runs, fd is the spool and sock the client
+    int sock, spool;
+    struct peer_t *remote;
+    struct line_reader_t in;
+    struct timeval idle;
     
     key = server = NULL;
     vald = 0;
     serv = NULL;
     ka = 0;
+    fed = 0;
+    remote = NULL;
+    sock = fd;
+    spool = -1;
+    // on the Unix socket the peer's ids stand in for a key
+    peer = peer_ids(fd, &uid, &gid) == 0;
+    admin = peer && valid_peer(uid, gid, NULL);
+    in.fd = fd;
+    in.start = in.len = 0;
+    idle.tv_sec = 10;
+    idle.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    // replies go out in several writes, which Nagle would hold back for
+    // the client's delayed ACK
+    on = 1;
+    if (!peer)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
     while (1) {
-        r = read_line(tmp, fd, 256);
+        // forwarded lines are longer by the server and key they come with
+        r = read_line(tmp, &in, fed ? sizeof(tmp) : 256);
         if (r == -2 && ka)
             continue;
         else if (r < 1)
             goto clean;
+        // any other line is held to the usual length
+        if (r >= 256 && strstr(tmp, "FORWARD ") != tmp)
+            goto clean;
+        begin = trace_now();
+        if (fed && strstr(tmp, "FORWARD ") == tmp) {
+            // FORWARD <server> <key> <command>, for a client of another node
+            spool = spool_open();
+            if (spool < 0) {
+                sprintf(msg, FORWARDF, (long long) strlen(INTERR));
+                qwrite(fd, msg);
+                qwrite(fd, INTERR);
+                goto next;
+            }
+            fd = spool;
+            fkey = strchr(tmp + 8, ' ');
+            command = fkey ? strchr(fkey + 1, ' ') : NULL;
+            if (!command) {
+                qwrite(fd, INVALID);
+                goto next;
+            }
+            *fkey++ = '\0';
+            *command++ = '\0';
+            serv = valid(fkey, tmp + 8) ? get_server(tmp + 8) : NULL;
+            if (strcmp(command, "KEY") == 0) {
+                qwrite(fd, serv ? OKKEY : BADKEY);
+                goto next;
+            } else if (!forwards(command) || strlen(command) >= 256) {
+                qwrite(fd, INVALID);
+                goto next;
+            }
+            // and on to the command as if the client had sent it here
+            memmove(tmp, command, strlen(command) + 1);
+        } else if (remote && vald && forwards(tmp)) {
+            if (peers_forward(remote, server, key, tmp, fd) < 0)
+                qwrite(fd, NONODE);
+            goto next;
+        }
         if (strstr(tmp, "SERVER ") == tmp) {
             free(server);
             server = strdup(tmp + 7);
-            vald = valid(key, server);
-            if (vald)
-                qwrite(fd, OKKEY);
-            else if (key)
-                qwrite(fd, BADKEY);
-            else
-                // purposely doesn't notify for invalid server, for security
-                qwrite(fd, SVNEXT);
+            phase = trace_now();
+            // the node that runs the server checks the key
+            remote = get_server(server) ? NULL : peers_route(server);
+            if (remote) {
+                vald = remote_login(fd, remote, server, key, SVNEXT);
+                trace_record("auth", NULL, phase);
+            } else {
+                vald = (peer && valid_peer(uid, gid, server)) || valid(key, server);
+                trace_record("auth", NULL, phase);
+                if (vald)
+                    qwrite(fd, OKKEY);
+                else if (key)
+                    qwrite(fd, BADKEY);
+                else
+                    // purposely doesn't notify for invalid server, for security
+                    qwrite(fd, SVNEXT);
+            }
         } else if (strstr(tmp, "KEY ") == tmp) {
             free(key);
             key = strdup(tmp + 4);
-            vald = valid(key, server);
-            if (vald)
-                qwrite(fd, OKKEY);
-            else if (key)
-                qwrite(fd, BADKEY);
-            else
-                qwrite(fd, KYNEXT);
+            phase = trace_now();
+            if (remote) {
+                vald = remote_login(fd, remote, server, key, KYNEXT);
+                trace_record("auth", NULL, phase);
+            } else {
+                vald = (peer && server && valid_peer(uid, gid, server)) || valid(key, server);
+                trace_record("auth", NULL, phase);
+                if (vald)
+                    qwrite(fd, OKKEY);
+                else if (key)
+                    qwrite(fd, BADKEY);
+                else
+                    qwrite(fd, KYNEXT);
+            }
+        } else if (remote && vald && strstr(tmp, "WATCH") == tmp) {
+            qwrite(fd, NOTHERE);
         } else if (strstr(tmp, "EXEC ") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
             sprintf(msg, "%s\n", tmp + 5);
-            if (server_send(serv, msg) == 0)
+            r = server_send(serv, msg);
+            if (r == 0)
                 qwrite(fd, OKEXEC);
+            else if (r == -2)
+                qwrite(fd, QFULL);
             else
                 qwrite(fd, EOFF);
         } else if (strstr(tmp, "KILL") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
             if (server_kill(serv, EXIT_PAUSE) == 0)
                 qwrite(fd, OKEXEC);
@@ -228,48 +853,209 @@ void control_read(int fd)
         } else if (strstr(tmp, "STOP") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
             server_stop(serv, EXIT_PAUSE);
             qwrite(fd, OKEXEC);
         } else if (strstr(tmp, "RESTART") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
             server_stop(serv, EXIT_RESTART);
             qwrite(fd, OKEXEC);
         } else if (strstr(tmp, "START") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
             server_resume(serv);
             qwrite(fd, OKEXEC);
         } else if (strstr(tmp, "STATUS") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
-            sprintf(msg, STATF, serv->status, difftime(time(NULL), serv->start));
+            // status, uptime, crashes in a row, seconds until the next start attempt
+            sprintf(msg, STATF, serv->status, difftime(time(NULL), serv->start), serv->failures,
+                    serv->next_attempt ? difftime(serv->next_attempt, time(NULL)) : 0.0);
             qwrite(fd, msg);
         } else if (strstr(tmp, "LOG") == tmp) {
             if (!serv) {
                 qwrite(fd, BADKEY);
-                continue;
+                goto next;
             }
-            if (tmp[3] == ' ') {
+            if (strstr(tmp, "LOG RANGE ") == tmp) {
+                send_range(fd, serv, tmp + 10);
+            } else if (tmp[3] == ' ') {
                 send_log(fd, serv, tmp + 4);
             } else {
                 send_log(fd, serv, NULL);
             }
+        } else if (strstr(tmp, "GREP ") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            send_grep(fd, serv, tmp + 5);
+        } else if (strstr(tmp, "RULES") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            send_rules(fd, serv);
+        } else if (strstr(tmp, "PERF") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            qwrite(fd, TSTART);
+            telemetry_report(serv, fd);
+            qwrite(fd, TEND);
+        } else if (strstr(tmp, "WATCHDOG") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            if (serv->watchdog) {
+                // hangs, seconds to detect and seconds to recover the last one
+                sprintf(msg, WATCHF, serv->watchdog->hangs, serv->watchdog->last_detection,
+                        serv->watchdog->last_recovery);
+                qwrite(fd, msg);
+            } else {
+                qwrite(fd, NOWATCH);
+            }
+        } else if (strstr(tmp, "WATCH") == tmp) {
+            // after WATCHDOG, which starts the same
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            send_watch(&in, serv, admin || valid_global(key),
+                       tmp[5] == ' ' ? strtoul(tmp + 6, NULL, 10) : events_last());
+        } else if (strstr(tmp, "PLACEMENT") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            char place[200];
+            placement_describe(serv, place, sizeof(place));
+            sprintf(msg, PLACEF, place);
+            qwrite(fd, msg);
+        } else if (strstr(tmp, "MEMORY") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            if (serv->memory) {
+                // RSS in MB, growth in MB per hour, seconds until a scheduled
+                // restart (0 for none), restarts so far
+                sprintf(msg, MEMF, serv->memory->current, serv->memory->slope,
+                        serv->memory->restart_at ? difftime(serv->memory->restart_at, time(NULL)) : 0.0,
+                        serv->memory->restarts);
+                qwrite(fd, msg);
+            } else {
+                qwrite(fd, NOMEM);
+            }
+        } else if (strstr(tmp, "FLOOD") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            if (serv->flood) {
+                // lines and bytes accepted, lines and bytes dropped, repeats folded
+                sprintf(msg, FLOODF, serv->flood->accepted_lines, serv->flood->accepted_bytes,
+                        serv->flood->total_dropped_lines, serv->flood->total_dropped_bytes,
+                        serv->flood->total_repeats);
+                qwrite(fd, msg);
+            } else {
+                qwrite(fd, NOFLOOD);
+            }
+        } else if (strstr(tmp, "CDS") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            if (serv->cds) {
+                // what this run does with the archive, then starts and average
+                // milliseconds until "Done", with and without it
+                sprintf(msg, CDSF,
+                        serv->cds->mode == CDS_USE ? "use" : serv->cds->mode == CDS_DUMP ? "dump" : "none",
+                        serv->cds->runs[1], serv->cds->runs[1] ? serv->cds->total_ms[1] / (long long) serv->cds->runs[1] : 0,
+                        serv->cds->runs[0], serv->cds->runs[0] ? serv->cds->total_ms[0] / (long long) serv->cds->runs[0] : 0);
+                qwrite(fd, msg);
+            } else {
+                qwrite(fd, NOCDS);
+            }
+        } else if (strstr(tmp, "SPARE") == tmp) {
+            if (!serv) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            if (serv->spare) {
+                // pid of the standby, whether it is warm, promotions, last promotion latency
+                sprintf(msg, SPAREF, serv->spare->pid, serv->spare->ready,
+                        serv->spare->promotions, serv->spare->last_promotion_ms);
+                qwrite(fd, msg);
+            } else {
+                qwrite(fd, NOSPARE);
+            }
+        } else if (strstr(tmp, "UPGRADE") == tmp) {
+            if (!serv || !(admin || valid_global(key))) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            qwrite(fd, UPGRADING);
+            // only returns if the new binary could not be started
+            if (handover_exec() < 0)
+                qwrite(fd, INTERR);
+        } else if (strstr(tmp, "TRACE") == tmp) {
+            if (!(admin || valid_global(key))) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            if (strcmp(tmp, "TRACE RESET") == 0) {
+                trace_reset();
+                qwrite(fd, OKEXEC);
+                goto next;
+            }
+            qwrite(fd, TSTART);
+            if (strcmp(tmp, "TRACE EVENTS") == 0)
+                trace_events(fd);
+            else if (strcmp(tmp, "TRACE JSON") == 0)
+                trace_json(fd);
+            else
+                trace_report(fd);
+            qwrite(fd, TEND);
+        } else if (strstr(tmp, "PEER ") == tmp) {
+            fed = peers_login(fd, tmp + 5);
+            if (fed) {
+                sprintf(msg, NODEF, peers_node());
+                qwrite(fd, msg);
+            } else {
+                qwrite(fd, BADKEY);
+            }
+        } else if (strstr(tmp, "INVENTORY") == tmp) {
+            if (!(fed || admin || valid_global(key))) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            send_inventory(fd);
+        } else if (strstr(tmp, "NODES") == tmp) {
+            if (!(admin || valid_global(key))) {
+                qwrite(fd, BADKEY);
+                goto next;
+            }
+            send_nodes(fd);
         } else if (strstr(tmp, "KEEPALIVE") == tmp) {
             ka = 1;
         } else {
             qwrite(fd, INVALID);
         }
-        if (vald) {
+        if (vald && !remote) {
+            phase = trace_now();
             serv = get_server(server);
+            trace_record("lookup", NULL, phase);
             if (!serv) {
                 qwrite(fd, INTERR);
                 goto clean;
@@ -277,9 +1063,22 @@ void control_read(int fd)
         } else {
             serv = NULL;
         }
+    next:
+        if (spool >= 0) {
+            send_spool(sock, spool);
+            close(spool);
+            spool = -1;
+            fd = sock;
+        }
+        trace_record(command_name(tmp), serv ? serv->id : NULL, begin);
+        // a forwarded command's login only lasts for that command
+        if (fed)
+            serv = NULL;
     }
 clean:
-    close(fd);
+    if (spool >= 0)
+        close(spool);
+    close(sock);
     free(key);
     free(server);
 }
@@ -289,24 +1088,37 @@ void *control_thread(void *data)
 #ifdef __APPLE__
     pthread_setname_np("mcmdd [connection]");
 #endif
-    control_read(*((int *)data));
+    control_read((int) (intptr_t) data);
     pthread_exit(NULL);
 }
 
 void control_accept()
 {
-    int fd, rc;
+    int fd, rc, i;
     void *status;
-    struct sockaddr_in ss;
-    socklen_t slen = sizeof(ss);
+    struct pollfd pfd[2];
     while (1) {
-        fd = accept(listener, (struct sockaddr *) &ss, &slen);
-        if (fd == -1 && errno == EINTR)
+        pfd[0].fd = listener;
+        pfd[1].fd = local;
+        pfd[0].events = pfd[1].events = POLLIN;
+        rc = poll(pfd, local >= 0 ? 2 : 1, -1);
+        if (rc == -1 && errno == EINTR)
             continue; // interrupted system call
+        else if (rc == -1)
+            err(1, "poll");
+        for (i = 0; i < 2 && !(pfd[i].revents & (POLLIN | POLLERR | POLLHUP)); ++i)
+            ;
+        if (i == 2)
+            continue;
+        fd = accept(pfd[i].fd, NULL, NULL);
+        if (fd == -1 && (errno == EINTR || errno == ECONNABORTED))
+            continue;
         else if (fd == -1)
             err(1, "accept");
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
         pthread_t threadId;
-        rc = pthread_create(&threadId, NULL, &control_thread, (void *) &fd);
+        // by value, the next accept() reuses fd before the thread may read it
+        rc = pthread_create(&threadId, NULL, &control_thread, (void *) (intptr_t) fd);
 #ifdef __linux__
         pthread_setname_np(threadId, "mcmdd [connection]");
 #endif
@@ -321,4 +1133,9 @@ void control_stop()
 {
     shutdown(listener, SHUT_RDWR);
     close(listener);
+    if (local >= 0) {
+        close(local);
+        if (sun.sun_path[0])
+            unlink(sun.sun_path);
+    }
 }
@@ -0,0 +1,154 @@
+//
+//  events.c
+//  mcmdd
+//
+//  Every start, stop, crash, backoff, backup and rule event is posted to
+//  a ring of the most recent events, each with the next sequence number.
+//  Watchers wait on a condition variable and read the ring from their own
+//  position, so a client that reconnects with the last number it saw
+//  gets everything it missed, as long as the ring still holds it. The
+//  numbering goes on across an UPGRADE, and the events from before it
+//  count as missed. Posting never waits for a watcher.
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "events.h"
+
+static struct event_t *ring;
+static int ring_len;
+// sequence number of the next event, the first is 1
+static unsigned long next_seq = 1;
+// the first one this daemon posted
+static unsigned long first_seq = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t posted = PTHREAD_COND_INITIALIZER;
+
+/*!
+ * @param capacity how many events a reconnecting watcher can catch up on
+ */
+void events_init(int capacity)
+{
+    if (capacity < 1)
+        capacity = 1;
+    ring = calloc(capacity, sizeof(struct event_t));
+    if (!ring)
+        err(1, "Failed to allocate memory");
+    ring_len = capacity;
+}
+
+/*!
+ * Continues the numbering of the daemon we took over from, before any
+ * event is posted.
+ * @param last the number of its latest event
+ */
+void events_resume(unsigned long last)
+{
+    pthread_mutex_lock(&lock);
+    if (next_seq == first_seq)
+        next_seq = first_seq = last + 1;
+    pthread_mutex_unlock(&lock);
+}
+
+/*!
+ * @param server the server's id, which must outlive the daemon's servers
+ * @param type a string literal naming the event
+ * @param format printf format for the detail, or NULL for none
+ */
+void events_post(const char *server, const char *type, const char *format, ...)
+{
+    struct event_t *event;
+    struct timeval tv;
+    va_list ap;
+
+    if (!ring)
+        return;
+    gettimeofday(&tv, NULL);
+    pthread_mutex_lock(&lock);
+    event = &ring[next_seq % ring_len];
+    event->seq = next_seq++;
+    event->time = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+    event->server = server;
+    event->type = type;
+    event->detail[0] = '\0';
+    if (format) {
+        va_start(ap, format);
+        vsnprintf(event->detail, sizeof(event->detail), format, ap);
+        va_end(ap);
+    }
+    pthread_cond_broadcast(&posted);
+    pthread_mutex_unlock(&lock);
+}
+
+/*!
+ * @return the sequence number of the latest event, 0 if there was none
+ */
+unsigned long events_last(void)
+{
+    unsigned long seq;
+    pthread_mutex_lock(&lock);
+    seq = next_seq - 1;
+    pthread_mutex_unlock(&lock);
+    return seq;
+}
+
+/*!
+ * Waits for the first event after *after and copies it out. If the ring
+ * has already moved past it, a "lost" event with the number of missed
+ * events comes first instead.
+ * @return 1 with *after moved on to the event, or 0 on timeout
+ */
+int events_next(unsigned long *after, struct event_t *out, int timeout_ms)
+{
+    struct timespec deadline;
+    struct timeval tv;
+    unsigned long oldest;
+    int rc = 0;
+
+    if (!ring)
+        return 0;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&lock);
+    while (*after + 1 >= next_seq && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&posted, &lock, &deadline);
+    if (*after + 1 >= next_seq) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    oldest = next_seq > ring_len ? next_seq - ring_len : 1;
+    if (oldest < first_seq)
+        oldest = first_seq;
+    if (*after + 1 < oldest) {
+        memset(out, 0, sizeof(*out));
+        out->seq = oldest - 1;
+        // none of ours yet after a handover, only the ones from before
+        if (oldest == next_seq) {
+            gettimeofday(&tv, NULL);
+            out->time = tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+        } else {
+            out->time = ring[oldest % ring_len].time;
+        }
+        out->type = "lost";
+        snprintf(out->detail, sizeof(out->detail), "%lu", oldest - 1 - *after);
+        *after = oldest - 1;
+    } else {
+        *out = ring[(*after + 1) % ring_len];
+        *after = out->seq;
+    }
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
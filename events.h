@@ -0,0 +1,31 @@
+//
+//  events.h
+//  mcmdd
+//
+//  Server state transitions, numbered in order, for WATCH.
+//
+
+#ifndef mcmdd_events_h
+#define mcmdd_events_h
+
+#define EVENT_DETAILMAX 64
+
+struct event_t {
+    unsigned long seq;
+    // unix time in milliseconds
+    long long time;
+    // the server's id, NULL for events about the stream itself
+    const char *server;
+    // a string literal such as "starting" or "stopped"
+    const char *type;
+    char detail[EVENT_DETAILMAX];
+};
+
+void events_init(int capacity);
+void events_post(const char *server, const char *type, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void events_resume(unsigned long last);
+unsigned long events_last(void);
+int events_next(unsigned long *after, struct event_t *out, int timeout_ms);
+
+#endif
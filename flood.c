@@ -0,0 +1,138 @@
+//
+//  flood.c
+//  mcmdd
+//
+//  A server printing in a tight loop would otherwise push everything
+//  useful out of its history and keep the logger busy. Lines are admitted
+//  against token buckets on lines and bytes (FLOOD_BURST seconds deep),
+//  and runs of one repeated line can be folded into a count. What was held
+//  back is summed up in the history at most every FLOOD_SUMMARY seconds,
+//  when the next line is admitted or, if the server has gone quiet, from
+//  the telemetry monitor's tick.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "flood.h"
+
+#define FLOOD_BURST 10
+#define FLOOD_SUMMARY 10
+
+void flood_init(struct server_t *server, double line_rate, double byte_rate, int dedup)
+{
+    struct flood_t *flood = calloc(1, sizeof(struct flood_t));
+    if (!flood)
+        err(1, "Failed to allocate memory");
+    flood->line_rate = line_rate;
+    flood->byte_rate = byte_rate;
+    flood->lines = line_rate * FLOOD_BURST;
+    flood->bytes = byte_rate * FLOOD_BURST;
+    flood->dedup = dedup;
+    flood->updated = flood->summarized = flood->seen = monotonic_ms();
+    pthread_mutex_init(&flood->lock, NULL);
+    server->flood = flood;
+}
+
+void flood_free(struct server_t *server)
+{
+    if (server->flood)
+        pthread_mutex_destroy(&server->flood->lock);
+    free(server->flood);
+    server->flood = NULL;
+}
+
+static void summarize(struct server_t *server, long long now)
+{
+    struct flood_t *flood = server->flood;
+    char msg[128];
+
+    if (flood->repeats) {
+        snprintf(msg, sizeof(msg), "[last line repeated %lu times]", flood->repeats);
+        server_note(server, msg);
+        printf("[%s] %s\n", server->id, msg);
+        flood->repeats = 0;
+    }
+    if (flood->dropped_lines && now - flood->summarized >= FLOOD_SUMMARY * 1000) {
+        snprintf(msg, sizeof(msg), "[suppressed %lu lines (%lu bytes) in %llds]",
+                 flood->dropped_lines, flood->dropped_bytes, (now - flood->summarized) / 1000);
+        server_note(server, msg);
+        printf("[%s] %s\n", server->id, msg);
+        flood->dropped_lines = flood->dropped_bytes = 0;
+        flood->summarized = now;
+    }
+}
+
+/*!
+ * @return 1 if the line should go to the history and log, 0 to drop it
+ */
+int flood_admit(struct server_t *server, const char *line)
+{
+    struct flood_t *flood = server->flood;
+    long long now;
+    double elapsed;
+    size_t len;
+
+    if (!flood)
+        return 1;
+    len = strlen(line) + 1;
+    now = monotonic_ms();
+    pthread_mutex_lock(&flood->lock);
+    flood->seen = now;
+    if (flood->dedup && strcmp(line, flood->last) == 0) {
+        flood->repeats++;
+        flood->total_repeats++;
+        pthread_mutex_unlock(&flood->lock);
+        return 0;
+    }
+    elapsed = (now - flood->updated) / 1000.0;
+    flood->updated = now;
+    if (flood->line_rate > 0) {
+        flood->lines += elapsed * flood->line_rate;
+        if (flood->lines > flood->line_rate * FLOOD_BURST)
+            flood->lines = flood->line_rate * FLOOD_BURST;
+    }
+    if (flood->byte_rate > 0) {
+        flood->bytes += elapsed * flood->byte_rate;
+        if (flood->bytes > flood->byte_rate * FLOOD_BURST)
+            flood->bytes = flood->byte_rate * FLOOD_BURST;
+    }
+    if ((flood->line_rate > 0 && flood->lines < 1)
+        || (flood->byte_rate > 0 && flood->bytes < len)) {
+        flood->dropped_lines++;
+        flood->dropped_bytes += len;
+        flood->total_dropped_lines++;
+        flood->total_dropped_bytes += len;
+        pthread_mutex_unlock(&flood->lock);
+        return 0;
+    }
+    flood->lines -= 1;
+    flood->bytes -= len;
+    summarize(server, now);
+    if (flood->dedup)
+        strncpy(flood->last, line, sizeof(flood->last) - 1);
+    flood->accepted_lines++;
+    flood->accepted_bytes += len;
+    pthread_mutex_unlock(&flood->lock);
+    return 1;
+}
+
+/*!
+ * Sums up what a server held back before it went quiet, which no later
+ * line would do. Called every second.
+ */
+void flood_tick(struct server_t *server)
+{
+    struct flood_t *flood = server->flood;
+    long long now;
+
+    if (!flood)
+        return;
+    now = monotonic_ms();
+    pthread_mutex_lock(&flood->lock);
+    if (now - flood->seen >= 1000)
+        summarize(server, now);
+    pthread_mutex_unlock(&flood->lock);
+}
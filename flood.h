@@ -0,0 +1,41 @@
+//
+//  flood.h
+//  mcmdd
+//
+//  Rate limits on console output going into history and the log.
+//
+
+#ifndef mcmdd_flood_h
+#define mcmdd_flood_h
+
+#include <pthread.h>
+
+#include "server.h"
+
+struct flood_t {
+    // the console reader admits lines, the telemetry monitor ticks
+    pthread_mutex_t lock;
+    // allowed lines and bytes per second, 0 for no limit
+    double line_rate, byte_rate;
+    double lines, bytes;
+    long long updated;
+    // fold runs of identical lines
+    int dedup;
+    char last[SERVER_LINEMAX];
+    unsigned long repeats;
+    // dropped since the last summary
+    unsigned long dropped_lines, dropped_bytes;
+    long long summarized;
+    // when the last line came in, admitted or not
+    long long seen;
+    // totals
+    unsigned long accepted_lines, accepted_bytes;
+    unsigned long total_dropped_lines, total_dropped_bytes, total_repeats;
+};
+
+void flood_init(struct server_t *server, double line_rate, double byte_rate, int dedup);
+int flood_admit(struct server_t *server, const char *line);
+void flood_tick(struct server_t *server);
+void flood_free(struct server_t *server);
+
+#endif
@@ -0,0 +1,227 @@
+//
+//  handover.c
+//  mcmdd
+//
+//  On UPGRADE the state of every server (pid, console pipes, status and
+//  history) is written to HANDOVER_STATE and the daemon execs its binary
+//  again with -r. The pipes and the control listeners stay open across the
+//  exec, and the servers remain our children, so the new image simply
+//  carries on reading their consoles. Hot spares are stopped first and
+//  started again afterwards.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "server.h"
+#include "spare.h"
+#include "hibernate.h"
+#include "handover.h"
+#include "input.h"
+#include "history.h"
+#include "statpage.h"
+#include "events.h"
+
+extern struct config_t *config;
+extern struct server_t **servers;
+extern int servers_sp;
+extern const char *program_path;
+
+struct server_t *get_server(const char *id);
+int control_listener(void);
+int control_local_listener(void);
+void control_adopt(int fd, int local_fd);
+void control_init();
+
+static void set_cloexec(int fd, int on)
+{
+    fcntl(fd, F_SETFD, on ? FD_CLOEXEC : 0);
+}
+
+static int running(struct server_t *server)
+{
+    return server->status == STATUS_STARTING || server->status == STATUS_RUNNING
+        || server->status == STATUS_STOPPING;
+}
+
+struct dump_t {
+    FILE *file;
+    int count;
+};
+
+static int dump_line(void *ctx, const struct history_line_t *line)
+{
+    struct dump_t *dump = ctx;
+    fprintf(dump->file, "%lld %lld %s\n", line->stamp.mono, line->stamp.wall, line->text);
+    dump->count++;
+    return 0;
+}
+
+static int write_state(const char *path, long long begin)
+{
+    FILE *file;
+    size_t i;
+    struct dump_t dump;
+    char *history;
+    size_t size;
+
+    file = fopen(path, "w");
+    if (!file)
+        return -1;
+    fprintf(file, "mcmdd-state 3\nbegin %lld\nlistener %d %d\nevents %lu\n", begin,
+            control_listener(), control_local_listener(), events_last());
+    for (i = 0; i < servers_sp; ++i) {
+        struct server_t *server = servers[i];
+        // the count goes first, but lines keep coming in while we write
+        dump.file = open_memstream(&history, &size);
+        dump.count = 0;
+        if (!dump.file) {
+            fclose(file);
+            return -1;
+        }
+        history_each(server->history, 0, dump_line, &dump);
+        fclose(dump.file);
+        fprintf(file, "server %s %d %d %d %d %d %ld %d %d %d\n", server->id,
+                running(server) ? server->pid : 0, server->pipein, server->pipeout,
+                server->status, server->ctrl, (long) server->start, server->failures,
+                server->hibernate && server->hibernate->listening, dump.count);
+        fwrite(history, 1, size, file);
+        free(history);
+    }
+    fprintf(file, "end\n");
+    return fclose(file);
+}
+
+int handover_exec(void)
+{
+    char *const argv[] = { (char *) program_path, "-n", "-r", HANDOVER_STATE, NULL };
+    long long begin;
+    size_t i;
+
+    for (i = 0; i < servers_sp; ++i) {
+        if (servers[i]->status == STATUS_BACKUP) {
+            printf("[daemon] Not upgrading during a backup of %s.\n", servers[i]->id);
+            return -1;
+        }
+    }
+    begin = monotonic_ms();
+    puts("[daemon] Handing over to a new daemon");
+    for (i = 0; i < servers_sp; ++i)
+        spare_stop(servers[i], MAX_WAIT);
+    if (write_state(HANDOVER_STATE, begin) < 0) {
+        warn("Failed to write handover state");
+        return -1;
+    }
+    // everything else is close-on-exec
+    set_cloexec(control_listener(), 0);
+    if (control_local_listener() >= 0)
+        set_cloexec(control_local_listener(), 0);
+    for (i = 0; i < servers_sp; ++i) {
+        if (running(servers[i])) {
+            set_cloexec(servers[i]->pipein, 0);
+            set_cloexec(servers[i]->pipeout, 0);
+        }
+    }
+    fflush(stdout);
+    // the new daemon makes a new status page
+    statpage_set_closed(1);
+    execv(program_path, argv);
+    warn("Failed to exec %s", program_path);
+    statpage_set_closed(0);
+    set_cloexec(control_listener(), 1);
+    if (control_local_listener() >= 0)
+        set_cloexec(control_local_listener(), 1);
+    for (i = 0; i < servers_sp; ++i) {
+        if (running(servers[i])) {
+            set_cloexec(servers[i]->pipein, 1);
+            set_cloexec(servers[i]->pipeout, 1);
+        }
+    }
+    unlink(HANDOVER_STATE);
+    return -1;
+}
+
+void handover_restore(const char *path)
+{
+    FILE *file;
+    struct server_t *server;
+    char id[256], line[SERVER_LINEMAX + 64];
+    struct history_stamp_t stamp;
+    long long begin;
+    long start;
+    unsigned long last_event;
+    int version, offset, listener, local, pid, pipein, pipeout, status, ctrl, failures, hibernating, count;
+
+    file = fopen(path, "r");
+    if (!file)
+        err(1, "Failed to open handover state %s", path);
+    // the Unix socket came later, an older daemon won't have passed it on
+    local = -1;
+    // versions 1, from before history was stamped, and 2, from before
+    // event numbers were carried over, are still read
+    if (!fgets(line, sizeof(line), file) || sscanf(line, "mcmdd-state %d", &version) != 1
+        || version < 1 || version > 3
+        || !fgets(line, sizeof(line), file) || sscanf(line, "begin %lld", &begin) != 1
+        || !fgets(line, sizeof(line), file)
+        || sscanf(line, "listener %d %d", &listener, &local) < 1)
+        errx(1, "Bad handover state %s", path);
+    if (version >= 3) {
+        if (!fgets(line, sizeof(line), file) || sscanf(line, "events %lu", &last_event) != 1)
+            errx(1, "Bad handover state %s", path);
+        events_resume(last_event);
+    }
+    if (listener >= 0)
+        control_adopt(listener, local);
+    else
+        control_init();
+    while (fgets(line, sizeof(line), file)
+           && sscanf(line, "server %255s %d %d %d %d %d %ld %d %d %d", id, &pid, &pipein,
+                     &pipeout, &status, &ctrl, &start, &failures, &hibernating, &count) == 10) {
+        server = get_server(id);
+        if (server) {
+            server->status = STATUS_STOPPED;
+            server->ctrl = ctrl == CTRL_PAUSE ? CTRL_PAUSE : CTRL_CLEAN;
+            server->start = start;
+            server->failures = failures;
+        }
+        for (; count > 0 && fgets(line, sizeof(line), file); --count) {
+            line[strcspn(line, "\n")] = '\0';
+            offset = 0;
+            // exactly one space before the text, which may start with more
+            if (version == 1 || sscanf(line, "%lld %lld%n", &stamp.mono, &stamp.wall, &offset) != 2)
+                history_now(&stamp);
+            else if (line[offset] == ' ')
+                offset++;
+            if (server)
+                history_restore(server->history, &stamp, line + offset);
+        }
+        if (pid > 0) {
+            set_cloexec(pipein, 1);
+            set_cloexec(pipeout, 1);
+        }
+        if (pid > 0 && !server) {
+            // dropped from the config in the meantime
+            printf("[%s] No longer configured, stopping PID %d.\n", id, pid);
+            write(pipein, SHUTDOWN_COMMAND, strlen(SHUTDOWN_COMMAND));
+            close(pipein);
+            close(pipeout);
+        } else if (pid > 0) {
+            server->pid = pid;
+            input_attach(server, pipein);
+            server->pipeout = pipeout;
+            server->status = status;
+            server->adopted = 1;
+            printf("[%s] Adopted PID %d.\n", id, pid);
+        } else if (server && hibernating && server->hibernate && server->ctrl == CTRL_PAUSE) {
+            hibernate_listen(server);
+        }
+    }
+    fclose(file);
+    unlink(path);
+    printf("[daemon] Handover completed in %lld ms.\n", monotonic_ms() - begin);
+}
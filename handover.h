@@ -0,0 +1,16 @@
+//
+//  handover.h
+//  mcmdd
+//
+//  Replaces the running daemon with a new binary without stopping servers.
+//
+
+#ifndef mcmdd_handover_h
+#define mcmdd_handover_h
+
+#define HANDOVER_STATE "mcmdd.state"
+
+int handover_exec(void);
+void handover_restore(const char *path);
+
+#endif
@@ -0,0 +1,235 @@
+//
+//  hibernate.c
+//  mcmdd
+//
+//  Idle servers are stopped to give their memory back, and mcmdd listens on
+//  the game port in their place. The first connection starts the server
+//  again and is proxied through to it once it is up, later players connect
+//  to the server directly.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "hibernate.h"
+#include "spare.h"
+#include "input.h"
+#include "telemetry.h"
+
+#define HIBERNATE_INTERVAL 30
+// how long a waking connection is held while the server boots
+#define WAKE_WAIT 120
+
+extern struct server_t **servers;
+extern int servers_sp;
+
+void hibernate_init(struct server_t *server, int idle, int port, const char *probe)
+{
+    struct hibernate_t *hib = malloc(sizeof(struct hibernate_t));
+    if (!hib)
+        err(1, "Failed to allocate memory");
+    hib->idle = idle;
+    hib->port = port;
+    hib->probe = NULL;
+    if (probe && probe[0]) {
+        hib->probe = malloc(strlen(probe) + 2);
+        if (!hib->probe)
+            err(1, "Failed to allocate memory");
+        sprintf(hib->probe, "%s\n", probe);
+    }
+    time(&hib->last_active);
+    hib->listening = 0;
+    server->hibernate = hib;
+}
+
+void hibernate_free(struct server_t *server)
+{
+    if (!server->hibernate)
+        return;
+    free(server->hibernate->probe);
+    free(server->hibernate);
+    server->hibernate = NULL;
+}
+
+/*!
+ * Copies traffic both ways until either side hangs up.
+ */
+static void proxy(int a, int b)
+{
+    struct pollfd pfd[2];
+    char buf[4096];
+    ssize_t r;
+    int i;
+
+    pfd[0].fd = a;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = b;
+    pfd[1].events = POLLIN;
+    while (1) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        for (i = 0; i < 2; ++i) {
+            if (!pfd[i].revents)
+                continue;
+            r = read(pfd[i].fd, buf, sizeof(buf));
+            if (r <= 0 || write(pfd[!i].fd, buf, r) != r)
+                return;
+        }
+    }
+}
+
+static int wake_listen(struct server_t *server)
+{
+    struct sockaddr_in sin;
+    int fd, one;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    // a server forked while we listen must not keep the port bound
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = INADDR_ANY;
+    sin.sin_port = htons(server->hibernate->port);
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 || listen(fd, 5) < 0) {
+        warn("[%s] Failed to listen on game port %d", server->id, server->hibernate->port);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *wake_thread(void *ptr)
+{
+    struct server_t *server = ptr;
+    struct hibernate_t *hib = server->hibernate;
+    struct sockaddr_in sin;
+    struct pollfd pfd;
+    int listener, client, upstream, waited;
+
+    listener = wake_listen(server);
+    if (listener < 0) {
+        server_resume(server);
+        hib->listening = 0;
+        return NULL;
+    }
+    printf("[%s] Hibernating, listening on port %d.\n", server->id, hib->port);
+    pfd.fd = listener;
+    pfd.events = POLLIN;
+    client = -1;
+    // give up listening if the server is started some other way
+    while (server->status == STATUS_STOPPED && server->ctrl == CTRL_PAUSE) {
+        if (poll(&pfd, 1, 1000) > 0) {
+            client = accept(listener, NULL, NULL);
+            if (client >= 0) {
+                fcntl(client, F_SETFD, FD_CLOEXEC);
+                break;
+            }
+        }
+    }
+    close(listener);
+    if (client < 0) {
+        hib->listening = 0;
+        return NULL;
+    }
+    printf("[%s] Waking for incoming connection.\n", server->id);
+    server_note(server, "Woken by incoming connection");
+    time(&hib->last_active);
+    server_resume(server);
+    for (waited = 0; server->status != STATUS_RUNNING && waited < WAKE_WAIT * 10; ++waited)
+        usleep(100000);
+    hib->listening = 0;
+    upstream = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(upstream, F_SETFD, FD_CLOEXEC);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(hib->port);
+    if (server->status == STATUS_RUNNING
+        && connect(upstream, (struct sockaddr *) &sin, sizeof(sin)) == 0)
+        proxy(client, upstream);
+    else
+        printf("[%s] Dropping waking connection, server did not come up.\n", server->id);
+    close(upstream);
+    close(client);
+    return NULL;
+}
+
+void hibernate_listen(struct server_t *server)
+{
+    struct hibernate_t *hib = server->hibernate;
+    int rc;
+
+    hib->listening = 1;
+    rc = pthread_create(&hib->thread, NULL, wake_thread, server);
+    if (rc) {
+        warn("pthread_create for hibernation of %s", server->id);
+        hib->listening = 0;
+        server_resume(server);
+        return;
+    }
+    pthread_detach(hib->thread);
+}
+
+static void hibernate(struct server_t *server)
+{
+    struct hibernate_t *hib = server->hibernate;
+
+    printf("[%s] Idle for %d seconds, hibernating.\n", server->id, hib->idle);
+    server_note(server, "Hibernating while idle");
+    hib->listening = 1;
+    server_stop_kill(server, EXIT_PAUSE, MAX_WAIT);
+    // a standby would keep holding the memory we are trying to give back
+    spare_stop(server, MAX_WAIT);
+    if (server->status != STATUS_STOPPED || server->ctrl != CTRL_PAUSE) {
+        hib->listening = 0;
+        return;
+    }
+    server->telemetry->players = -1;
+    hibernate_listen(server);
+}
+
+void *hibernate_monitor(void *ptr)
+{
+    size_t i;
+    time_t now, active;
+
+    while (1) {
+        sleep(HIBERNATE_INTERVAL);
+        time(&now);
+        for (i = 0; i < servers_sp; ++i) {
+            struct server_t *server = servers[i];
+            struct hibernate_t *hib = server->hibernate;
+            if (!hib || hib->listening || server->status != STATUS_RUNNING)
+                continue;
+            if (hib->probe) {
+                // straight to the console, the history is for what users send
+                input_push(server, hib->probe, strlen(hib->probe));
+                active = hib->last_active;
+                if (server->telemetry->last_players > active)
+                    active = server->telemetry->last_players;
+            } else {
+                active = server->last_read;
+            }
+            if (active < server->start)
+                active = server->start;
+            if (difftime(now, active) >= hib->idle)
+                hibernate(server);
+        }
+    }
+}
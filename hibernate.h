@@ -0,0 +1,33 @@
+//
+//  hibernate.h
+//  mcmdd
+//
+//  Stops idle servers and starts them again on the first connection.
+//
+
+#ifndef mcmdd_hibernate_h
+#define mcmdd_hibernate_h
+
+#include <pthread.h>
+
+#include "server.h"
+
+struct hibernate_t {
+    // seconds without players before the server is stopped
+    int idle;
+    // game port to listen on while hibernating
+    int port;
+    // console command answering with the player count, NULL to go by output
+    char *probe;
+    // when the server was last woken
+    time_t last_active;
+    volatile int listening;
+    pthread_t thread;
+};
+
+void hibernate_init(struct server_t *server, int idle, int port, const char *probe);
+void hibernate_listen(struct server_t *server);
+void hibernate_free(struct server_t *server);
+void *hibernate_monitor(void *ptr);
+
+#endif
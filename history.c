@@ -0,0 +1,487 @@
+//
+//  history.c
+//  mcmdd
+//
+//  Console output is very repetitive, so history is kept as a tail of raw
+//  lines and, once the tail reaches HISTORY_BLOCK bytes, older blocks
+//  deflated with zlib. The block is compressed by whichever thread sealed
+//  it, outside the lock, so readers and other writers only wait for the
+//  copy. The oldest blocks are dropped when the history goes over its
+//  memory budget. Readers decompress one block at a time into their own
+//  buffer and never hold the lock while they use the lines. Every sealed
+//  block also gets a bloom filter of the trigrams in its lines, so a
+//  search only decompresses the blocks that may hold its pattern.
+//
+//  Each line is stamped with the monotonic and wall clock when it comes
+//  in. A block keeps the stamps of its lines ahead of their text, so a
+//  time is found by a binary search over the blocks' first and last
+//  stamps and then over the stamps of one block, of which only the stamps
+//  need to be inflated.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "history.h"
+#include "server.h"
+
+#define STAMPS_SIZE (HISTORY_LINES * sizeof(struct history_stamp_t))
+// what a reader needs to hold the tail or any block
+#define BUFFER_SIZE (STAMPS_SIZE + HISTORY_BLOCK)
+
+struct history_t *history_new(size_t budget)
+{
+    struct history_t *history = calloc(1, sizeof(struct history_t));
+    if (!history)
+        err(1, "Failed to allocate memory");
+    history->tail = malloc(HISTORY_BLOCK);
+    history->stamps = malloc(STAMPS_SIZE);
+    if (!history->tail || !history->stamps)
+        err(1, "Failed to allocate memory");
+    pthread_mutex_init(&history->lock, NULL);
+    history->budget = budget;
+    history->used = BUFFER_SIZE;
+    return history;
+}
+
+void history_now(struct history_stamp_t *stamp)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stamp->mono = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    stamp->wall = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void history_free(struct history_t *history)
+{
+    int i;
+    for (i = 0; i < history->nblocks; ++i) {
+        free(history->blocks[i]->data);
+        free(history->blocks[i]);
+    }
+    pthread_mutex_destroy(&history->lock);
+    free(history->blocks);
+    free(history->tail);
+    free(history->stamps);
+    free(history);
+}
+
+static inline unsigned trigram(const unsigned char *p)
+{
+    return (unsigned) p[0] << 16 | (unsigned) p[1] << 8 | p[2];
+}
+
+// two bit positions per trigram, from two multiplicative hashes
+static inline void bloom_set(unsigned char *bloom, unsigned key)
+{
+    unsigned a = key * 2654435761u >> (32 - HISTORY_BLOOM_BITS);
+    unsigned b = key * 2246822519u >> (32 - HISTORY_BLOOM_BITS);
+    bloom[a >> 3] |= 1 << (a & 7);
+    bloom[b >> 3] |= 1 << (b & 7);
+}
+
+static inline int bloom_get(const unsigned char *bloom, unsigned key)
+{
+    unsigned a = key * 2654435761u >> (32 - HISTORY_BLOOM_BITS);
+    unsigned b = key * 2246822519u >> (32 - HISTORY_BLOOM_BITS);
+    return (bloom[a >> 3] >> (a & 7) & 1) && (bloom[b >> 3] >> (b & 7) & 1);
+}
+
+static int bloom_keys(const char *pattern, size_t len, unsigned *keys)
+{
+    size_t i;
+    int n = 0;
+    for (i = 0; i + 3 <= len; ++i)
+        keys[n++] = trigram((const unsigned char *) pattern + i);
+    return n;
+}
+
+static int bloom_check(const unsigned char *bloom, const unsigned *keys, int nkeys)
+{
+    int i;
+    for (i = 0; i < nkeys; ++i)
+        if (!bloom_get(bloom, keys[i]))
+            return 0;
+    return 1;
+}
+
+// trigrams of every line, none of them spanning two lines
+static void bloom_build(unsigned char *bloom, const char *raw, size_t len)
+{
+    const unsigned char *p = (const unsigned char *) raw, *end = p + len;
+    memset(bloom, 0, HISTORY_BLOOM);
+    for (; p + 3 <= end; ++p) {
+        if (p[2] == '\0')
+            p += 2;
+        else if (p[0] && p[1])
+            bloom_set(bloom, trigram(p));
+    }
+}
+
+// called with the lock held
+static void evict(struct history_t *history)
+{
+    struct history_block_t *block;
+    int n = 0;
+    // a block still being compressed is in use by its sealer
+    while (history->used > history->budget && n < history->nblocks
+           && !history->blocks[n]->pending) {
+        block = history->blocks[n++];
+        history->used -= block->size + sizeof(struct history_block_t);
+        free(block->data);
+        free(block);
+    }
+    if (n > 0) {
+        history->nblocks -= n;
+        memmove(history->blocks, history->blocks + n, history->nblocks * sizeof(*history->blocks));
+    }
+}
+
+// called with the lock held, copies the tail into a new block
+static struct history_block_t *seal(struct history_t *history)
+{
+    struct history_block_t *block = malloc(sizeof(struct history_block_t));
+    size_t stamps = history->tail_count * sizeof(struct history_stamp_t);
+    if (!block)
+        err(1, "Failed to allocate memory");
+    if (history->nblocks == history->cap) {
+        history->cap = history->cap ? history->cap * 2 : 16;
+        history->blocks = realloc(history->blocks, history->cap * sizeof(*history->blocks));
+        if (!history->blocks)
+            err(1, "Failed to allocate memory");
+    }
+    block->first = history->tail_first;
+    block->count = history->tail_count;
+    block->first_mono = history->stamps[0].mono;
+    block->last_mono = history->stamps[history->tail_count - 1].mono;
+    block->raw = block->size = stamps + history->tail_len;
+    block->data = malloc(block->raw);
+    if (!block->data)
+        err(1, "Failed to allocate memory");
+    memcpy(block->data, history->stamps, stamps);
+    memcpy(block->data + stamps, history->tail, history->tail_len);
+    block->pending = 1;
+    history->blocks[history->nblocks++] = block;
+    history->used += block->size + sizeof(struct history_block_t);
+
+    history->tail_first += history->tail_count;
+    history->tail_len = 0;
+    history->tail_count = 0;
+    return block;
+}
+
+static void compress_block(struct history_t *history, struct history_block_t *block)
+{
+    uLongf size = compressBound(block->raw);
+    unsigned char *out = malloc(size), *shrunk;
+    size_t stamps;
+    if (!out)
+        err(1, "Failed to allocate memory");
+    // only this thread touches a pending block, and its raw lines don't change
+    if (compress2(out, &size, block->data, block->raw, Z_DEFAULT_COMPRESSION) != Z_OK)
+        errx(1, "Failed to compress history");
+    stamps = block->count * sizeof(struct history_stamp_t);
+    bloom_build(block->bloom, (const char *) block->data + stamps, block->raw - stamps);
+    shrunk = realloc(out, size);
+    if (shrunk)
+        out = shrunk;
+
+    pthread_mutex_lock(&history->lock);
+    free(block->data);
+    block->data = out;
+    history->used -= block->raw;
+    history->used += size;
+    block->size = size;
+    block->pending = 0;
+    evict(history);
+    pthread_mutex_unlock(&history->lock);
+}
+
+static unsigned long append(struct history_t *history, const struct history_stamp_t *stamp,
+                            const char *line)
+{
+    struct history_block_t *sealed = NULL;
+    size_t len = strcspn(line, "\n");
+    unsigned long seq;
+
+    if (len >= HISTORY_BLOCK)
+        len = HISTORY_BLOCK - 1;
+    pthread_mutex_lock(&history->lock);
+    if (history->tail_len + len + 1 > HISTORY_BLOCK || history->tail_count == HISTORY_LINES)
+        sealed = seal(history);
+    memcpy(history->tail + history->tail_len, line, len);
+    history->tail[history->tail_len + len] = '\0';
+    history->tail_len += len + 1;
+    history->stamps[history->tail_count] = *stamp;
+    seq = history->tail_first + history->tail_count++;
+    pthread_mutex_unlock(&history->lock);
+    if (sealed)
+        compress_block(history, sealed);
+    return seq;
+}
+
+/*!
+ * Stores one line, cut at its first newline, stamped with the current time.
+ * @return the sequence number of the line
+ */
+unsigned long history_add(struct history_t *history, const char *line)
+{
+    struct history_stamp_t stamp;
+    history_now(&stamp);
+    return append(history, &stamp, line);
+}
+
+/*!
+ * Stores a line with the stamp it had before, such as across a handover.
+ * Stamps must not go back in time.
+ */
+unsigned long history_restore(struct history_t *history, const struct history_stamp_t *stamp,
+                              const char *line)
+{
+    return append(history, stamp, line);
+}
+
+/*!
+ * @return sequence number of the oldest line still kept
+ */
+unsigned long history_first(struct history_t *history)
+{
+    unsigned long first;
+    pthread_mutex_lock(&history->lock);
+    first = history->nblocks ? history->blocks[0]->first : history->tail_first;
+    pthread_mutex_unlock(&history->lock);
+    return first;
+}
+
+/*!
+ * @return sequence number the next line will get
+ */
+unsigned long history_next(struct history_t *history)
+{
+    unsigned long next;
+    pthread_mutex_lock(&history->lock);
+    next = history->tail_first + history->tail_count;
+    pthread_mutex_unlock(&history->lock);
+    return next;
+}
+
+// called with the lock held, index of the block holding seq, or nblocks
+// when that is in the tail
+static int find_block(struct history_t *history, unsigned long seq)
+{
+    int lo = 0, hi = history->nblocks, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (history->blocks[mid]->first + history->blocks[mid]->count > seq)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// called with the lock held. Copies out the block holding seq, or the
+// tail, as stamps followed by text, and returns the length of the text,
+// or 0 if the block's filter rules out one of the keys
+static size_t fetch(struct history_t *history, unsigned long seq, const unsigned *keys,
+                    int nkeys, char *buf, unsigned long *base, int *count)
+{
+    struct history_block_t *block;
+    size_t stamps;
+    uLongf len;
+    int i;
+
+    i = find_block(history, seq);
+    if (i == history->nblocks) {
+        stamps = history->tail_count * sizeof(struct history_stamp_t);
+        memcpy(buf, history->stamps, stamps);
+        memcpy(buf + stamps, history->tail, history->tail_len);
+        *base = history->tail_first;
+        *count = history->tail_count;
+        return history->tail_len;
+    }
+    block = history->blocks[i];
+    *base = block->first;
+    *count = block->count;
+    if (!block->pending && !bloom_check(block->bloom, keys, nkeys))
+        return 0;
+    len = block->raw;
+    if (block->pending)
+        memcpy(buf, block->data, block->raw);
+    else if (uncompress((unsigned char *) buf, &len, block->data, block->size) != Z_OK)
+        errx(1, "Corrupt history block");
+    return block->raw - block->count * sizeof(struct history_stamp_t);
+}
+
+static unsigned long lower_bound(const struct history_stamp_t *stamps, int count, long long mono)
+{
+    int lo = 0, hi = count, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (stamps[mid].mono >= mono)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/*!
+ * @return sequence number of the first line stamped at or after the
+ *   monotonic time mono, or history_next() if there is none
+ */
+unsigned long history_seek(struct history_t *history, long long mono)
+{
+    struct history_stamp_t *stamps;
+    struct history_block_t *block;
+    unsigned long seq;
+    uLongf len;
+    int lo, hi, mid, rc;
+
+    pthread_mutex_lock(&history->lock);
+    lo = 0;
+    hi = history->nblocks;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (history->blocks[mid]->last_mono >= mono)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (lo == history->nblocks) {
+        seq = history->tail_first + lower_bound(history->stamps, history->tail_count, mono);
+    } else if (history->blocks[lo]->first_mono >= mono) {
+        seq = history->blocks[lo]->first;
+    } else {
+        block = history->blocks[lo];
+        len = block->count * sizeof(struct history_stamp_t);
+        stamps = malloc(len);
+        if (!stamps)
+            err(1, "Failed to allocate memory");
+        if (block->pending) {
+            memcpy(stamps, block->data, len);
+        } else {
+            // the stamps come first, so inflating stops short of the text
+            rc = uncompress((unsigned char *) stamps, &len, block->data, block->size);
+            if (rc != Z_OK && rc != Z_BUF_ERROR)
+                errx(1, "Corrupt history block");
+        }
+        seq = block->first + lower_bound(stamps, block->count, mono);
+        free(stamps);
+    }
+    pthread_mutex_unlock(&history->lock);
+    return seq;
+}
+
+/*!
+ * Calls fn for every line from sequence number from (or the oldest kept)
+ * up to the last line added before the call, oldest first.
+ */
+void history_each(struct history_t *history, unsigned long from, history_fn fn, void *ctx)
+{
+    struct history_stamp_t *stamps;
+    struct history_line_t line;
+    unsigned long seq, base, end;
+    const char *text;
+    char *buf;
+    int i, count;
+
+    buf = malloc(BUFFER_SIZE);
+    if (!buf)
+        err(1, "Failed to allocate memory");
+    stamps = (struct history_stamp_t *) buf;
+    seq = from;
+    end = history_next(history);
+    while (seq < end) {
+        pthread_mutex_lock(&history->lock);
+        fetch(history, seq, NULL, 0, buf, &base, &count);
+        pthread_mutex_unlock(&history->lock);
+
+        text = buf + count * sizeof(struct history_stamp_t);
+        for (i = 0; i < count && base + i < end; ++i) {
+            if (base + i >= seq) {
+                line.seq = base + i;
+                line.stamp = stamps[i];
+                line.text = text;
+                if (fn(ctx, &line))
+                    goto done;
+            }
+            text += strlen(text) + 1;
+        }
+        if (base + count <= seq)
+            break;
+        seq = base + count;
+    }
+done:
+    free(buf);
+}
+
+/*!
+ * Calls fn for up to limit lines containing pattern, oldest first, from
+ * sequence number from onwards. Blocks whose filter is missing one of the
+ * pattern's trigrams are not decompressed at all.
+ * @return number of matching lines
+ */
+int history_grep(struct history_t *history, const char *pattern, unsigned long from,
+                 int limit, history_fn fn, void *ctx)
+{
+    unsigned keys[SERVER_LINEMAX];
+    struct history_stamp_t *stamps;
+    struct history_line_t match;
+    unsigned long seq, base, end, at;
+    size_t plen, len;
+    char *buf, *hit, *line, *next, *stop;
+    int nkeys, count, matches;
+
+    plen = strlen(pattern);
+    if (plen == 0 || plen >= SERVER_LINEMAX || limit < 1)
+        return 0;
+    nkeys = bloom_keys(pattern, plen, keys);
+    buf = malloc(BUFFER_SIZE);
+    if (!buf)
+        err(1, "Failed to allocate memory");
+    stamps = (struct history_stamp_t *) buf;
+    matches = 0;
+    seq = from;
+    end = history_next(history);
+    while (seq < end) {
+        pthread_mutex_lock(&history->lock);
+        len = fetch(history, seq, keys, nkeys, buf, &base, &count);
+        pthread_mutex_unlock(&history->lock);
+        if (base + count <= seq)
+            break;
+
+        // one memmem over the whole block, lines are only walked to number the hits
+        line = buf + count * sizeof(struct history_stamp_t);
+        stop = line + len;
+        at = base;
+        while (line < stop && (hit = memmem(line, stop - line, pattern, plen)) != NULL) {
+            while ((next = memchr(line, '\0', hit - line)) != NULL) {
+                line = next + 1;
+                at++;
+            }
+            if (at >= end)
+                break;
+            if (at >= seq) {
+                match.seq = at;
+                match.stamp = stamps[at - base];
+                match.text = line;
+                matches++;
+                if (fn(ctx, &match) || matches >= limit)
+                    goto done;
+            }
+            line += strlen(line) + 1;
+            at++;
+        }
+        seq = base + count;
+    }
+done:
+    free(buf);
+    return matches;
+}
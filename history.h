@@ -0,0 +1,81 @@
+//
+//  history.h
+//  mcmdd
+//
+//  Console history: an uncompressed tail plus older compressed blocks.
+//
+
+#ifndef mcmdd_history_h
+#define mcmdd_history_h
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define DEFAULT_HISTORY_MEMORY (1024 * 1024)
+// text size or line count at which the tail is sealed into a block
+#define HISTORY_BLOCK 65536
+#define HISTORY_LINES 4096
+// trigram filter per block, in bits as a power of two
+#define HISTORY_BLOOM_BITS 14
+#define HISTORY_BLOOM (1 << HISTORY_BLOOM_BITS >> 3)
+
+// when a line came in, both in microseconds
+struct history_stamp_t {
+    long long mono, wall;
+};
+
+struct history_block_t {
+    // sequence number of the first line, and how many lines follow it
+    unsigned long first;
+    int count;
+    // monotonic stamps of the first and last line
+    long long first_mono, last_mono;
+    // a stamp for each line, then the lines back to back, each
+    // terminated by a null
+    size_t raw;
+    size_t size;
+    unsigned char *data;
+    // still holds the raw lines while it is being compressed, and
+    // until then the filter is not filled in
+    int pending;
+    // trigrams occurring in the block's lines
+    unsigned char bloom[HISTORY_BLOOM];
+};
+
+struct history_t {
+    pthread_mutex_t lock;
+    // the tail, with lines numbered from tail_first
+    struct history_stamp_t *stamps;
+    char *tail;
+    size_t tail_len;
+    int tail_count;
+    unsigned long tail_first;
+    // sealed blocks, oldest first
+    struct history_block_t **blocks;
+    int nblocks, cap;
+    size_t budget, used;
+};
+
+struct history_line_t {
+    unsigned long seq;
+    struct history_stamp_t stamp;
+    const char *text;
+};
+
+// return non-zero to stop
+typedef int (*history_fn)(void *ctx, const struct history_line_t *line);
+
+struct history_t *history_new(size_t budget);
+void history_now(struct history_stamp_t *stamp);
+unsigned long history_add(struct history_t *history, const char *line);
+unsigned long history_restore(struct history_t *history, const struct history_stamp_t *stamp,
+                              const char *line);
+unsigned long history_first(struct history_t *history);
+unsigned long history_next(struct history_t *history);
+unsigned long history_seek(struct history_t *history, long long mono);
+void history_each(struct history_t *history, unsigned long from, history_fn fn, void *ctx);
+int history_grep(struct history_t *history, const char *pattern, unsigned long from,
+                 int limit, history_fn fn, void *ctx);
+void history_free(struct history_t *history);
+
+#endif
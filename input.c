@@ -0,0 +1,190 @@
+//
+//  input.c
+//  mcmdd
+//
+//  server_send() only appends to the server's bounded queue, so a server
+//  that stops reading its stdin can't block the control thread that sent
+//  the command. One writer thread polls the non-blocking pipes of all
+//  servers with pending input and writes everything queued for a server
+//  at once. The pipe is swapped in and out under the queue lock, so the
+//  writer never sees a descriptor that was closed underneath it.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "input.h"
+
+extern struct server_t **servers;
+extern int servers_sp;
+
+// wakes the writer when a queue goes from empty to not empty
+static int wake[2] = { -1, -1 };
+
+struct input_t *input_new(size_t cap)
+{
+    struct input_t *input = malloc(sizeof(struct input_t));
+    if (!input)
+        err(1, "Failed to allocate memory");
+    input->buf = malloc(cap);
+    if (!input->buf)
+        err(1, "Failed to allocate memory");
+    pthread_mutex_init(&input->lock, NULL);
+    input->head = input->len = 0;
+    input->cap = cap;
+    return input;
+}
+
+void input_free(struct input_t *input)
+{
+    pthread_mutex_destroy(&input->lock);
+    free(input->buf);
+    free(input);
+}
+
+static int push(struct server_t *server, const char *message, size_t len, size_t reserve)
+{
+    struct input_t *input = server->input;
+    size_t tail, first;
+    int was_empty;
+
+    pthread_mutex_lock(&input->lock);
+    if (server->pipein < 0) {
+        pthread_mutex_unlock(&input->lock);
+        return -1;
+    }
+    if (input->len + len + reserve > input->cap) {
+        pthread_mutex_unlock(&input->lock);
+        return -2;
+    }
+    tail = (input->head + input->len) % input->cap;
+    first = input->cap - tail < len ? input->cap - tail : len;
+    memcpy(input->buf + tail, message, first);
+    memcpy(input->buf, message + first, len - first);
+    was_empty = input->len == 0;
+    input->len += len;
+    pthread_mutex_unlock(&input->lock);
+    if (was_empty && wake[1] >= 0)
+        write(wake[1], "", 1);
+    return 0;
+}
+
+/*!
+ * Leaves INPUT_RESERVE bytes of the queue free.
+ * @return 0 if queued, -1 if there is no process to send to, or -2 if
+ *   the queue has no room for the whole message
+ */
+int input_push(struct server_t *server, const char *message, size_t len)
+{
+    return push(server, message, len, INPUT_RESERVE);
+}
+
+/*!
+ * Like input_push(), but may use the reserve, for the shutdown command.
+ */
+int input_push_urgent(struct server_t *server, const char *message, size_t len)
+{
+    return push(server, message, len, 0);
+}
+
+void input_attach(struct server_t *server, int fd)
+{
+    struct input_t *input = server->input;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    pthread_mutex_lock(&input->lock);
+    // whatever was queued for the previous process is dropped
+    input->head = input->len = 0;
+    server->pipein = fd;
+    pthread_mutex_unlock(&input->lock);
+}
+
+void input_detach(struct server_t *server)
+{
+    struct input_t *input = server->input;
+
+    pthread_mutex_lock(&input->lock);
+    if (server->pipein >= 0)
+        close(server->pipein);
+    server->pipein = -1;
+    input->head = input->len = 0;
+    pthread_mutex_unlock(&input->lock);
+}
+
+/*!
+ * Writes as much of the queue as the pipe takes, in one call.
+ */
+static void drain(struct server_t *server)
+{
+    struct input_t *input = server->input;
+    struct iovec iov[2];
+    ssize_t written;
+    size_t first;
+
+    pthread_mutex_lock(&input->lock);
+    if (server->pipein < 0 || input->len == 0) {
+        pthread_mutex_unlock(&input->lock);
+        return;
+    }
+    first = input->cap - input->head < input->len ? input->cap - input->head : input->len;
+    iov[0].iov_base = input->buf + input->head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = input->buf;
+    iov[1].iov_len = input->len - first;
+    written = writev(server->pipein, iov, iov[1].iov_len ? 2 : 1);
+    if (written > 0) {
+        input->head = (input->head + written) % input->cap;
+        input->len -= written;
+    } else if (written < 0 && errno != EAGAIN && errno != EINTR) {
+        // the server is gone, nobody will read this any more
+        input->head = input->len = 0;
+    }
+    pthread_mutex_unlock(&input->lock);
+}
+
+void *input_writer(void *ptr)
+{
+    struct pollfd *pfd;
+    struct server_t **pending;
+    size_t i;
+    int n;
+    char buf[64];
+
+    if (pipe(wake) < 0)
+        err(1, "pipe for input writer");
+    fcntl(wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake[1], F_SETFD, FD_CLOEXEC);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    pfd = malloc(sizeof(struct pollfd) * (servers_sp + 1));
+    pending = malloc(sizeof(struct server_t *) * servers_sp);
+    if (!pfd || !pending)
+        err(1, "Failed to allocate memory");
+    while (1) {
+        pfd[0].fd = wake[0];
+        pfd[0].events = POLLIN;
+        for (n = 0, i = 0; i < servers_sp; ++i) {
+            struct server_t *server = servers[i];
+            pthread_mutex_lock(&server->input->lock);
+            if (server->input->len > 0 && server->pipein >= 0) {
+                pfd[n + 1].fd = server->pipein;
+                pfd[n + 1].events = POLLOUT;
+                pending[n++] = server;
+            }
+            pthread_mutex_unlock(&server->input->lock);
+        }
+        if (poll(pfd, n + 1, -1) < 0)
+            continue; // interrupted sys call
+        if (pfd[0].revents)
+            read(wake[0], buf, sizeof(buf));
+        for (i = 0; i < n; ++i)
+            if (pfd[i + 1].revents)
+                drain(pending[i]);
+    }
+}
@@ -0,0 +1,34 @@
+//
+//  input.h
+//  mcmdd
+//
+//  Queued console input, written to the servers by a single thread.
+//
+
+#ifndef mcmdd_input_h
+#define mcmdd_input_h
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "server.h"
+
+#define DEFAULT_INPUT_QUEUE 65536
+// kept free for the shutdown command, so a full queue can't hold up a STOP
+#define INPUT_RESERVE (sizeof(SHUTDOWN_COMMAND) - 1)
+
+struct input_t {
+    pthread_mutex_t lock;
+    char *buf;
+    size_t head, len, cap;
+};
+
+struct input_t *input_new(size_t cap);
+int input_push(struct server_t *server, const char *message, size_t len);
+int input_push_urgent(struct server_t *server, const char *message, size_t len);
+void input_attach(struct server_t *server, int fd);
+void input_detach(struct server_t *server);
+void input_free(struct input_t *input);
+void *input_writer(void *ptr);
+
+#endif
@@ -19,12 +19,32 @@
 
 #include "config.h"
 #include "server.h"
+#include "spare.h"
+#include "hibernate.h"
+#include "rules.h"
+#include "telemetry.h"
+#include "watchdog.h"
+#include "placement.h"
+#include "memory.h"
+#include "handover.h"
+#include "input.h"
+#include "flood.h"
+#include "history.h"
+#include "trace.h"
+#include "statpage.h"
+#include "events.h"
+#include "reader.h"
+#include "cds.h"
+#include "peers.h"
 
 const char *program_name;
+// absolute path of our binary, which a handover execs again
+const char *program_path;
 struct config_t *config;
 struct server_t **servers;
 pthread_t **threads;
-pthread_t backup_thread;
+pthread_t backup_thread, hibernate_thread, telemetry_thread, watchdog_thread, memory_thread;
+pthread_t input_thread, reader_thread, peers_thread;
 int servers_sp, threads_sp;
 
 void control_init();
@@ -33,7 +53,7 @@ void control_stop();
 
 static void usage(void)
 {
-    fprintf(stderr, "usage: %s [-nf] [-d path]\n", program_name);
+    fprintf(stderr, "usage: %s [-nf] [-d path] [-u user] [-r state]\n", program_name);
     exit(1);
 }
 
@@ -58,14 +78,69 @@ struct server_t *get_server(const char *id)
 
 static void load_server(const char *name)
 {
-    const char *path, *command;
+    const char *path, *command, *rule;
+    struct server_t *server;
+    int idle, port, iter, deadline;
+    long queue, history;
+    double line_rate, byte_rate;
+    int dedup;
 
     printf("[%s] Loading\n", name);
     
     path = config_get(config, name, "path", "");
     command = config_get(config, name, "command", DEFAULT_COMMAND);
     
-    servers[servers_sp++] = server_new(path, command, name);
+    server = server_new(path, command, name);
+    if (strcmp(config_get(config, name, "spare", "0"), "1") == 0) {
+        spare_init(server, config_get(config, name, "spare_path", path),
+                   config_get(config, name, "spare_command", command));
+    }
+    iter = 0;
+    while ((rule = config_next(config, name, "rule", &iter)) != NULL) {
+        if (rules_add(server->rules, rule) < 0)
+            warnx("[%s] Ignoring bad rule: %s", name, rule);
+    }
+    rules_compile(server->rules);
+    idle = port = 0;
+    sscanf(config_get(config, name, "hibernate", "0"), "%d", &idle);
+    sscanf(config_get(config, name, "hibernate_port", "25565"), "%d", &port);
+    if (idle > 0) {
+        // configured in minutes
+        hibernate_init(server, idle * 60, port,
+                       config_get(config, name, "hibernate_probe", "list"));
+    }
+    deadline = 0;
+    sscanf(config_get(config, name, "watchdog", "0"), "%d", &deadline);
+    if (deadline > 0)
+        watchdog_init(server, deadline, config_get(config, name, "watchdog_probe", "list"));
+    if (placement_init(server, config_get(config, name, "cpus", ""),
+                       config_get(config, name, "numa", ""),
+                       config_get(config, name, "nice", ""),
+                       config_get(config, name, "ionice", "")) < 0)
+        errx(1, "[%s] Bad cpus, numa, nice or ionice setting", name);
+    history = atol(config_get(config, name, "history_memory", "0"));
+    if (history > 0) {
+        // configured in kilobytes
+        history_free(server->history);
+        server->history = history_new(history * 1024);
+    }
+    queue = atol(config_get(config, name, "input_queue", "0"));
+    if (queue > 0) {
+        input_free(server->input);
+        server->input = input_new(queue);
+    }
+    if (strcmp(config_get(config, name, "memory_restart", "0"), "1") == 0)
+        memory_init(server, atol(config_get(config, name, "memory_limit", "0")),
+                    atol(config_get(config, name, "memory_slope", "0")));
+    line_rate = byte_rate = 0;
+    sscanf(config_get(config, name, "flood_lines", "0"), "%lf", &line_rate);
+    sscanf(config_get(config, name, "flood_bytes", "0"), "%lf", &byte_rate);
+    dedup = strcmp(config_get(config, name, "flood_dedup", "0"), "1") == 0;
+    if (line_rate > 0 || byte_rate > 0 || dedup)
+        flood_init(server, line_rate, byte_rate, dedup);
+    if (strcmp(config_get(config, name, "cds", "0"), "1") == 0)
+        cds_init(server, config_get(config, name, "cds_archive", DEFAULT_CDS_ARCHIVE));
+    servers[servers_sp++] = server;
 }
 
 static void load_servers()
@@ -118,27 +193,155 @@ static inline int server_has_warmed_up(struct server_t *server)
     return duration > warmup;
 }
 
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static double budget_tokens = -1;
+static long long budget_updated;
+
+/*!
+ * Host-wide token bucket for server boots, so many servers crashing at
+ * once can't all boot a JVM at the same time.
+ * @return 0 if a boot may go ahead, or the seconds until a token is due
+ */
+static int restart_budget_take(void)
+{
+    double rate, burst;
+    long long now;
+    int wait;
+
+    rate = atof(config_get(config, NULL, "restart_rate", "0")) / 60;
+    if (rate <= 0)
+        return 0;
+    burst = atof(config_get(config, NULL, "restart_burst", "4"));
+    now = monotonic_ms();
+    pthread_mutex_lock(&budget_lock);
+    if (budget_tokens < 0)
+        budget_tokens = burst;
+    budget_tokens += (now - budget_updated) / 1000.0 * rate;
+    if (budget_tokens > burst)
+        budget_tokens = burst;
+    budget_updated = now;
+    wait = 0;
+    if (budget_tokens >= 1)
+        budget_tokens -= 1;
+    else
+        wait = (int) ((1 - budget_tokens) / rate) + 1;
+    pthread_mutex_unlock(&budget_lock);
+    return wait;
+}
+
+/*!
+ * Sleeps until next_attempt, or until a START, STOP or shutdown comes in.
+ * @return 0 for exit immediate, 1 to go on
+ */
+static int server_wait_attempt(struct server_t *server)
+{
+    while (time(NULL) < server->next_attempt) {
+        if (server->ctrl == CTRL_EXIT)
+            return 0;
+        if (server->ctrl != CTRL_CLEAN)
+            break;
+        sleep(1);
+    }
+    server->next_attempt = 0;
+    return 1;
+}
+
+/*!
+ * Delays the next start after a crash, exponentially with jitter.
+ * @return 0 for exit immediate, 1 to go on
+ */
+static int server_backoff(struct server_t *server)
+{
+    int base, max, attempts, delay, i;
+
+    base = atoi(config_get(config, server->id, "backoff", "5"));
+    max = atoi(config_get(config, server->id, "backoff_max", "300"));
+    attempts = atoi(config_get(config, server->id, "restart_attempts", "0"));
+    server->failures++;
+    if (attempts > 0 && server->failures >= attempts) {
+        printf("[%s] Paused - crashed %d times without staying up.\n", server->id, server->failures);
+        server->ctrl = CTRL_PAUSE;
+        statpage_update(server);
+        events_post(server->id, "paused", "%d", server->failures);
+        return 1;
+    }
+    for (delay = base, i = 1; i < server->failures && delay < max; ++i)
+        delay *= 2;
+    if (delay > max)
+        delay = max;
+    // anywhere from half to the full delay, so servers that crashed
+    // together don't come back together
+    if (delay > 1)
+        delay = delay / 2 + random() % (delay - delay / 2 + 1);
+    printf("[%s] Crashed %d times without staying up, next attempt in %d seconds.\n",
+           server->id, server->failures, delay);
+    server->next_attempt = time(NULL) + delay;
+    statpage_update(server);
+    events_post(server->id, "backoff", "%d", delay);
+    return server_wait_attempt(server);
+}
+
 void *thread_start_wrapper(void *ptr)
 {
     struct server_t *server = ptr;
+    int wait;
 #ifdef __APPLE__
     pthread_setname_np(server->id);
 #endif
+    // stopped by hand before a handover, so stay that way
+    if (server->ctrl == CTRL_PAUSE && !server->adopted && server_pause_loop(server) == 0)
+        return NULL;
     while (1) {
-        server->ctrl = CTRL_CLEAN;
-        server_start(server);
+        int promoted;
+        if (server->adopted) {
+            // still running from before a handover, and stays stopped
+            // once it exits if a STOP came before the handover
+            server->adopted = 0;
+            promoted = 1;
+        } else {
+            server->ctrl = CTRL_CLEAN;
+            // a warm standby takes over straight away, and a new one is
+            // started in the background once this server is running
+            promoted = spare_promote(server) == 0;
+        }
+        statpage_update(server);
+        spare_launch(server);
+        if (promoted) {
+            server_monitor(server);
+        } else {
+            while ((wait = restart_budget_take()) > 0) {
+                printf("[%s] Host restart budget used up, waiting %d seconds.\n", server->id, wait);
+                server->next_attempt = time(NULL) + wait;
+                statpage_update(server);
+                if (server_wait_attempt(server) == 0)
+                    return NULL;
+                // stopped while it waited, so it stays down until started
+                if (server->ctrl == CTRL_PAUSE && server_pause_loop(server) == 0)
+                    return NULL;
+                server->ctrl = CTRL_CLEAN;
+            }
+            server_start(server);
+        }
         // set when the daemon is killing all other servers, so quit
-        if (server->ctrl == CTRL_EXIT)
+        if (server->ctrl == CTRL_EXIT) {
+            placement_release(server);
             return NULL;
-        // do not start the server up immediately unless x seconds have passed
-        if (server->ctrl == CTRL_CLEAN && !server_has_warmed_up(server)) {
-            printf("[%s] Paused - failed to keep server running long enough.\n", server->id);
-            server->ctrl = CTRL_PAUSE;
         }
-        // set by control when a shutdown is anticipated
-        if (server->ctrl == CTRL_PAUSE
-            && server_pause_loop(server) == 0)
-            return NULL;
+        // the server went down on its own
+        if (server->ctrl == CTRL_CLEAN) {
+            if (server_has_warmed_up(server))
+                server->failures = 0;
+            else if (server_backoff(server) == 0)
+                return NULL;
+            statpage_update(server);
+        }
+        // set by control when a shutdown is anticipated. the cores of a
+        // paused server go back to the pool
+        if (server->ctrl == CTRL_PAUSE) {
+            placement_release(server);
+            if (server_pause_loop(server) == 0)
+                return NULL;
+        }
     }
 }
 
@@ -175,6 +378,7 @@ static void kill_servers()
     for (i = 0; i < servers_sp; ++i) {
         server_kill(servers[i], EXIT_FULL);
         pthread_join(*threads[i], &status);
+        spare_stop(servers[i], 0);
     }
 }
 
@@ -187,6 +391,7 @@ static void stop_servers()
     for (i = 0; i < servers_sp; ++i) {
         server_stop_kill(servers[i], EXIT_FULL, MAX_WAIT);
         pthread_join(*threads[i], &status);
+        spare_stop(servers[i], MAX_WAIT);
     }
 }
 
@@ -196,6 +401,7 @@ void *backup_monitor(void *ptr)
     const char *freq_s, *backup_command;
     char backup_folder[256], backup_name[256], command[256];
     int freq, tmin, rc;
+    long long begin;
     time_t now;
     struct tm *timeinfo;
     
@@ -235,10 +441,12 @@ void *backup_monitor(void *ptr)
             }
             strncat(backup_folder, backup_name, sizeof(backup_folder) - strlen(backup_folder) - 1);
             snprintf(command, sizeof(command), backup_command, backup_folder, server->id);
+            begin = trace_now();
             // stop the server
             server_stop_kill(server, EXIT_PAUSE, MAX_WAIT);
             // prevent clients from starting the server during a backup
             server_set_backup(server, 1);
+            events_post(server->id, "backup_begin", NULL);
             printf("[%s] Running scheduled backup.\n", server->id);
             printf("[%s] >%s\n", server->id, command);
             rc = system(command);
@@ -251,7 +459,10 @@ void *backup_monitor(void *ptr)
             }
             // unlock and bring the server back online
             server_set_backup(server, 0);
+            events_post(server->id, "backup_end", "%d", rc);
             server_resume(server);
+            // stop, copy and the request to start again
+            trace_record("backup", server->id, begin);
         }
     }
 }
@@ -265,6 +476,126 @@ static void start_backup_monitor()
         err(1, "pthread_create for backup monitor");
 }
 
+static void start_hibernate_monitor()
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < servers_sp; ++i)
+        if (servers[i]->hibernate)
+            break;
+    if (i == servers_sp)
+        return;
+    rc = pthread_create(&hibernate_thread, NULL, hibernate_monitor, NULL);
+    if (rc)
+        err(1, "pthread_create for hibernate monitor");
+#ifdef __linux__
+    pthread_setname_np(hibernate_thread, "mcmdd [hibernate]");
+#endif
+}
+
+static void start_telemetry_monitor()
+{
+    size_t i;
+    int rc;
+
+    // only needed when a server asks for periodic tps probes, or for
+    // summing up flood drops of a server that went quiet
+    for (i = 0; i < servers_sp; ++i)
+        if (atoi(config_get(config, servers[i]->id, "tps_interval", "0")) > 0
+            || servers[i]->flood)
+            break;
+    if (i == servers_sp)
+        return;
+    rc = pthread_create(&telemetry_thread, NULL, telemetry_monitor, NULL);
+    if (rc)
+        err(1, "pthread_create for telemetry monitor");
+#ifdef __linux__
+    pthread_setname_np(telemetry_thread, "mcmdd [telemetry]");
+#endif
+}
+
+static void start_watchdog_monitor()
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < servers_sp; ++i)
+        if (servers[i]->watchdog)
+            break;
+    if (i == servers_sp)
+        return;
+    rc = pthread_create(&watchdog_thread, NULL, watchdog_monitor, NULL);
+    if (rc)
+        err(1, "pthread_create for watchdog");
+#ifdef __linux__
+    pthread_setname_np(watchdog_thread, "mcmdd [watchdog]");
+#endif
+}
+
+static void start_memory_monitor()
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < servers_sp; ++i)
+        if (servers[i]->memory)
+            break;
+    if (i == servers_sp)
+        return;
+    rc = pthread_create(&memory_thread, NULL, memory_monitor, NULL);
+    if (rc)
+        err(1, "pthread_create for memory monitor");
+#ifdef __linux__
+    pthread_setname_np(memory_thread, "mcmdd [memory]");
+#endif
+}
+
+static void start_input_writer()
+{
+    int rc;
+
+    rc = pthread_create(&input_thread, NULL, input_writer, NULL);
+    if (rc)
+        err(1, "pthread_create for input writer");
+#ifdef __linux__
+    pthread_setname_np(input_thread, "mcmdd [input]");
+#endif
+}
+
+static void start_console_reader()
+{
+    enum reader_backend_t backend;
+    int rc;
+
+    // one pipe per server at a time, a hot spare reads its own until promoted
+    backend = reader_init(config_get(config, NULL, "io_backend", "auto"), servers_sp);
+    printf("[daemon] Reading consoles with %s\n", reader_backend_name());
+    if (backend == READER_THREADS)
+        return;
+    rc = pthread_create(&reader_thread, NULL, reader_loop, NULL);
+    if (rc)
+        err(1, "pthread_create for console reader");
+#ifdef __linux__
+    pthread_setname_np(reader_thread, "mcmdd [reader]");
+#endif
+}
+
+static void start_peers()
+{
+    int rc;
+
+    if (!peers_init())
+        return;
+    printf("[daemon] Joining the federation as %s\n", peers_node());
+    rc = pthread_create(&peers_thread, NULL, peers_loop, NULL);
+    if (rc)
+        err(1, "pthread_create for peers");
+#ifdef __linux__
+    pthread_setname_np(peers_thread, "mcmdd [peers]");
+#endif
+}
+
 static void cleanup()
 {
     size_t i;
@@ -275,6 +606,13 @@ static void cleanup()
     
     config_free(config);
     for (i = 0; i < servers_sp; ++i) {
+        spare_free(servers[i]);
+        hibernate_free(servers[i]);
+        watchdog_free(servers[i]);
+        placement_free(servers[i]);
+        memory_free(servers[i]);
+        flood_free(servers[i]);
+        cds_free(servers[i]);
         server_free(servers[i]);
     }
     for (i = 0; i < threads_sp; ++i) {
@@ -300,6 +638,7 @@ void signal_handler(int signum)
     if (signum == SIGTERM)
         kill_servers();
     control_stop();
+    statpage_set_closed(1);
     pthread_cancel(backup_thread);
     puts("[daemon] Cleaning up");
     cleanup();
@@ -354,14 +693,28 @@ static inline void change_user(const char *name)
 int main(int argc, char **argv)
 {
     int ch, dofork;
-    char *data_dir;
+    char *data_dir, *state, path[4096];
+    ssize_t len;
     
     program_name = argv[0];
+    // resolved now, as both the working directory and the binary may change
+    len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len > 0) {
+        path[len] = '\0';
+        program_path = strdup(path);
+    } else {
+        program_path = realpath(argv[0], NULL);
+        if (!program_path)
+            program_path = argv[0];
+    }
     dofork = 0; // change to 1 for release
     data_dir = NULL;
+    state = NULL;
     setbuf(stdout, NULL);
+    // jitter for restart backoff
+    srandom(time(NULL) ^ getpid());
     
-    while ((ch = getopt(argc, argv, "nfd:u:")) != -1) {
+    while ((ch = getopt(argc, argv, "nfd:u:r:")) != -1) {
         switch (ch) {
             case 'n':
                 dofork = 0;
@@ -375,6 +728,9 @@ int main(int argc, char **argv)
             case 'u':
                 change_user(optarg);
                 break;
+            case 'r':
+                state = strdup(optarg);
+                break;
             case '?':
             default:
                 usage();
@@ -393,11 +749,31 @@ int main(int argc, char **argv)
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGCHLD, signal_handler);
+    // a server that exits while we write to it must not take us down
+    signal(SIGPIPE, SIG_IGN);
     
     load_config();
-    control_init();
+    trace_init(atoi(config_get(config, NULL, "trace_events", "0")));
+    events_init(atoi(config_get(config, NULL, "watch_events", "1024")));
+    if (!state)
+        control_init();
     load_servers();
+    if (state) {
+        // adopt the servers and control socket of the daemon we replace
+        handover_restore(state);
+        free(state);
+    }
+    // monitoring tools can read server state from this file, see statpage.h
+    if (strlen(config_get(config, NULL, "status_page", "")) > 0)
+        statpage_create(config_get(config, NULL, "status_page", ""), servers, servers_sp);
+    start_input_writer();
+    start_console_reader();
     run_servers();
     start_backup_monitor();
+    start_hibernate_monitor();
+    start_telemetry_monitor();
+    start_watchdog_monitor();
+    start_memory_monitor();
+    start_peers();
     control_accept();
 }
@@ -8,7 +8,7 @@ License:        GPLv2+
 URL:            https://cmastudios.me/mcmdd
 Source0:        %{name}-%{version}.tar.gz
 
-BuildRequires:  cmake,gcc-c++,systemd
+BuildRequires:  cmake,gcc-c++,systemd,zlib-devel
 
 %description
 mcmdd monitors, controls, and restarts other application servers. It has
@@ -37,6 +37,7 @@ systemctl enable mcmdd
 %files
 %doc
 /usr/bin/mcmdd
+/usr/bin/mcmdd-status
 /var/lib/mcmdd/mcmdd.conf
 %{_unitdir}/mcmdd.service
 
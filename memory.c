@@ -0,0 +1,260 @@
+//
+//  memory.c
+//  mcmdd
+//
+//  The RSS of each opted-in server is sampled and fitted to a line. A server
+//  that goes over its absolute limit or grows faster than its slope limit,
+//  or the biggest one while the host is under memory pressure (PSI), gets
+//  a graceful restart. Players are warned and the restart happens as soon
+//  as nobody is online, or after memory_grace seconds at the latest. Only
+//  one server is scheduled at a time, the fastest growing first.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "config.h"
+#include "memory.h"
+#include "telemetry.h"
+
+// need this much history before trusting the slope
+#define SLOPE_SPAN 900
+// PSI avg60 still shows pressure this long after a restart relieved it
+#define PRESSURE_WINDOW 60
+
+extern struct config_t *config;
+extern struct server_t **servers;
+extern int servers_sp;
+
+// the last server restarted to free memory, and when it was back up
+static struct server_t *restarted;
+static time_t settled_at;
+
+void memory_init(struct server_t *server, long limit, long slope_limit)
+{
+    struct memory_t *memory = calloc(1, sizeof(struct memory_t));
+    if (!memory)
+        err(1, "Failed to allocate memory");
+    memory->limit = limit;
+    memory->slope_limit = slope_limit;
+    server->memory = memory;
+}
+
+void memory_free(struct server_t *server)
+{
+    free(server->memory);
+    server->memory = NULL;
+}
+
+/*!
+ * @return resident set size of the process in MB, or -1 if unknown
+ */
+static long read_rss(pid_t pid)
+{
+    char path[64], line[256];
+    FILE *file;
+    long kb;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    file = fopen(path, "r");
+    if (!file)
+        return -1;
+    kb = -1;
+    while (fgets(line, sizeof(line), file))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(file);
+    return kb < 0 ? -1 : kb / 1024;
+}
+
+/*!
+ * @return the "some" avg60 memory pressure of the host in percent, or -1
+ *   without PSI support
+ */
+static double read_pressure(void)
+{
+    FILE *file;
+    double avg10, avg60;
+
+    file = fopen("/proc/pressure/memory", "r");
+    if (!file)
+        return -1;
+    if (fscanf(file, "some avg10=%lf avg60=%lf", &avg10, &avg60) != 2)
+        avg60 = -1;
+    fclose(file);
+    return avg60;
+}
+
+static void sample(struct server_t *server, time_t now)
+{
+    struct memory_t *memory = server->memory;
+    double x, y, sx, sy, sxx, sxy, n;
+    long rss;
+    int i;
+
+    // a new process starts a new trend
+    if (memory->pid != server->pid) {
+        memory->pid = server->pid;
+        memory->sp = memory->len = 0;
+        memory->slope = 0;
+        memory->restart_at = 0;
+    }
+    rss = read_rss(server->pid);
+    if (rss < 0)
+        return;
+    memory->current = rss;
+    memory->rss[memory->sp] = rss;
+    memory->times[memory->sp] = now;
+    memory->sp = (memory->sp + 1) % MEMORY_SAMPLES;
+    if (memory->len < MEMORY_SAMPLES)
+        memory->len++;
+    // least squares over the samples, hours against MB
+    sx = sy = sxx = sxy = 0;
+    n = memory->len;
+    for (i = 0; i < memory->len; ++i) {
+        x = difftime(memory->times[i], now) / 3600;
+        y = memory->rss[i];
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    if (n > 1 && n * sxx - sx * sx > 0)
+        memory->slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+static int over_limit(struct server_t *server)
+{
+    struct memory_t *memory = server->memory;
+    int oldest;
+
+    if (memory->limit > 0 && memory->current > memory->limit)
+        return 1;
+    oldest = memory->len < MEMORY_SAMPLES ? 0 : memory->sp;
+    return memory->slope_limit > 0 && memory->slope > memory->slope_limit
+        && memory->len > 1 && difftime(time(NULL), memory->times[oldest]) >= SLOPE_SPAN;
+}
+
+static void warn_players(struct server_t *server, time_t now)
+{
+    const char *format;
+    char msg[256];
+    int minutes;
+
+    format = config_get(config, NULL, "memory_warning",
+                        "say This server will restart in %d minutes.");
+    minutes = (int) ((difftime(server->memory->restart_at, now) + 59) / 60);
+    snprintf(msg, sizeof(msg), format, minutes);
+    strncat(msg, "\n", sizeof(msg) - strlen(msg) - 1);
+    server_send(server, msg);
+}
+
+// a count from before since may be long out of date
+static int nobody_online(struct server_t *server, time_t since)
+{
+    return server->telemetry->players == 0 && server->telemetry->players_at >= since;
+}
+
+static void schedule(struct server_t *server, time_t now, const char *why)
+{
+    struct memory_t *memory = server->memory;
+
+    memory->scheduled_at = now;
+    memory->restart_at = now + atoi(config_get(config, NULL, "memory_grace", "300"));
+    memory->warned = 0;
+    printf("[%s] Scheduling restart, %s (%ld MB, %+.0f MB/h).\n", server->id, why,
+           memory->current, memory->slope);
+    server_note(server, "Restart scheduled to free memory");
+    // whoever is online hears it now, tick() restarts once a fresh count is 0
+    warn_players(server, now);
+    server->telemetry->players = -1;
+    server_send(server, "list\n");
+}
+
+static void tick(struct server_t *server, time_t now)
+{
+    struct memory_t *memory = server->memory;
+
+    if (!memory->restart_at)
+        return;
+    // nobody online is the quiet moment we were waiting for
+    if (nobody_online(server, memory->scheduled_at) || now >= memory->restart_at) {
+        printf("[%s] Restarting to free memory.\n", server->id);
+        restarted = server;
+        settled_at = 0;
+        memory->restart_at = 0;
+        memory->restarts++;
+        server_stop(server, EXIT_RESTART);
+        return;
+    }
+    if (!memory->warned && difftime(memory->restart_at, now) <= 60) {
+        memory->warned = 1;
+        warn_players(server, now);
+    }
+    // keep the player count fresh until then
+    server_send(server, "list\n");
+}
+
+/*!
+ * Whether the last restart has had its effect on the pressure figure: the
+ * server is running again (or was stopped) for a whole PSI window, so one
+ * spike doesn't restart one server after another.
+ */
+static int pressure_settled(time_t now)
+{
+    if (!restarted)
+        return 1;
+    if (restarted->status != STATUS_RUNNING && restarted->ctrl != CTRL_PAUSE) {
+        settled_at = 0;
+        return 0;
+    }
+    if (!settled_at)
+        settled_at = now;
+    return now - settled_at >= PRESSURE_WINDOW;
+}
+
+void *memory_monitor(void *ptr)
+{
+    size_t i;
+    time_t now;
+    double pressure, max_pressure;
+    struct server_t *pick, *biggest;
+    int pending, settled;
+
+    while (1) {
+        sleep(MEMORY_INTERVAL);
+        time(&now);
+        max_pressure = atof(config_get(config, NULL, "memory_pressure", "0"));
+        pressure = max_pressure > 0 ? read_pressure() : -1;
+        settled = pressure_settled(now);
+        pick = biggest = NULL;
+        pending = 0;
+        for (i = 0; i < servers_sp; ++i) {
+            struct server_t *server = servers[i];
+            struct memory_t *memory = server->memory;
+            if (!memory || server->status != STATUS_RUNNING)
+                continue;
+            sample(server, now);
+            tick(server, now);
+            // still counts while tick() has it going down
+            if (memory->restart_at || server->status != STATUS_RUNNING) {
+                pending = 1;
+                continue;
+            }
+            if (!biggest || memory->current > biggest->memory->current)
+                biggest = server;
+            if (over_limit(server) && (!pick || memory->slope > pick->memory->slope))
+                pick = server;
+        }
+        // one restart at a time, so the host isn't left without servers
+        if (pending)
+            continue;
+        if (pick)
+            schedule(pick, now, "over its memory limit");
+        else if (biggest && max_pressure > 0 && pressure > max_pressure && settled)
+            schedule(biggest, now, "host under memory pressure");
+    }
+}
@@ -0,0 +1,36 @@
+//
+//  memory.h
+//  mcmdd
+//
+//  Restarts leaking servers before the kernel OOM-kills them.
+//
+
+#ifndef mcmdd_memory_h
+#define mcmdd_memory_h
+
+#include "server.h"
+
+// one sample per MEMORY_INTERVAL seconds, two hours worth
+#define MEMORY_INTERVAL 30
+#define MEMORY_SAMPLES 240
+
+struct memory_t {
+    // restart above this RSS or growth, in MB and MB per hour, 0 for none
+    long limit, slope_limit;
+    long rss[MEMORY_SAMPLES];
+    time_t times[MEMORY_SAMPLES];
+    int sp, len;
+    pid_t pid;
+    // current RSS in MB and growth in MB per hour
+    long current;
+    double slope;
+    // a restart is scheduled for this time, 0 when none
+    time_t scheduled_at, restart_at;
+    int warned, restarts;
+};
+
+void memory_init(struct server_t *server, long limit, long slope_limit);
+void memory_free(struct server_t *server);
+void *memory_monitor(void *ptr);
+
+#endif
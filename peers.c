@@ -0,0 +1,632 @@
+//
+//  peers.c
+//  mcmdd
+//
+//  Federation of several mcmdd nodes. Each node logs in to the ones in its
+//  "peers" list with the shared peer_key, and a node that is logged in to
+//  adds the other to its own list, so one side naming the other is enough.
+//  Every peer_refresh seconds each node fetches the ids and status of its
+//  peers' servers with INVENTORY, which makes the table that routes
+//  SERVER logins for servers that don't run here. A login for a server
+//  that isn't in the table wakes the refresh early rather than waiting for
+//  it, so a server just added on another node can be reached a second later.
+//
+//  A command for a server on another node goes there as
+//  "FORWARD <server> <key> <command>". The node that runs the server checks
+//  the key, so a node never needs the keys of the others' servers, and
+//  answers "OK Forward <length>" and then that many bytes of reply, which
+//  are relayed back to the client as they come in. A console line in a LOG
+//  can read like any other reply line, so only the length tells where the
+//  reply ends. The control protocol has no request ids to tell replies
+//  apart on a shared socket, so each forwarded command has a connection to
+//  itself for the round trip and then puts it back in the peer's pool; a
+//  few connections, kept open between commands, carry the commands of any
+//  number of clients.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "config.h"
+#include "trace.h"
+#include "peers.h"
+
+// idle connections kept open to each peer
+#define PEER_IDLE 8
+// seconds for connecting and for each read of a reply
+#define PEER_TIMEOUT 5
+
+// as control.c frames replies of more than one line
+#define REPLY_START "OK Send start."
+#define REPLY_END "OK Send end."
+// comes before a forwarded reply, with its length in bytes
+#define REPLY_FORWARD "OK Forward %lld"
+
+struct route_t {
+    char *id;
+    int status;
+};
+
+struct peer_conn_t {
+    int fd;
+    int start, len;
+    char buf[65536];
+};
+
+struct peer_t {
+    // as given in peers, or the address of a node that logged in to us
+    char *host, *port;
+    // the node's own name, from its answer to PEER
+    char name[64];
+    int up;
+    // guards name and the idle connections
+    pthread_mutex_t lock;
+    struct peer_conn_t *idle[PEER_IDLE];
+    int nidle;
+    // sorted by id, replaced on every refresh
+    struct route_t *routes;
+    int nroutes;
+};
+
+extern struct config_t *config;
+
+static char node[64];
+static const char *peer_key = "", *own_port;
+static int refresh_secs;
+// guards the peer list and every peer's routes
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct peer_t **peers;
+static int npeers;
+// a route that missed wakes the loop to refresh early
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+static int missed;
+
+static struct peer_t *peer_add(const char *host, const char *port)
+{
+    struct peer_t *peer, **grown;
+
+    peer = calloc(1, sizeof(struct peer_t));
+    if (!peer)
+        err(1, "Failed to allocate memory");
+    peer->host = strdup(host);
+    peer->port = strdup(port);
+    if (!peer->host || !peer->port)
+        err(1, "Failed to allocate memory");
+    snprintf(peer->name, sizeof(peer->name), "%s:%s", host, port);
+    pthread_mutex_init(&peer->lock, NULL);
+    pthread_rwlock_wrlock(&table_lock);
+    grown = realloc(peers, (npeers + 1) * sizeof(struct peer_t *));
+    if (!grown)
+        err(1, "Failed to allocate memory");
+    peers = grown;
+    peers[npeers++] = peer;
+    pthread_rwlock_unlock(&table_lock);
+    return peer;
+}
+
+static struct peer_t *peer_at(int i)
+{
+    struct peer_t *peer = NULL;
+    pthread_rwlock_rdlock(&table_lock);
+    if (i < npeers)
+        peer = peers[i];
+    pthread_rwlock_unlock(&table_lock);
+    return peer;
+}
+
+/*!
+ * Reads the peers list, "host:port" entries separated by spaces.
+ * @return 1 if this node takes part in a federation
+ */
+int peers_init(void)
+{
+    char host[256], *string, *tofree, *token, *colon;
+
+    if (gethostname(host, sizeof(host)) < 0)
+        strcpy(host, "mcmdd");
+    host[sizeof(host) - 1] = '\0';
+    snprintf(node, sizeof(node), "%s", config_get(config, NULL, "node", host));
+    peer_key = config_get(config, NULL, "peer_key", "");
+    own_port = config_get(config, NULL, "port", "8361");
+    refresh_secs = atoi(config_get(config, NULL, "peer_refresh", "10"));
+    if (refresh_secs < 1)
+        refresh_secs = 1;
+
+    tofree = string = strdup(config_get(config, NULL, "peers", ""));
+    if (!string)
+        err(1, "strdup");
+    while ((token = strsep(&string, " ")) != NULL) {
+        if (strlen(token) < 1)
+            continue;
+        colon = strrchr(token, ':');
+        if (colon)
+            *colon = '\0';
+        peer_add(token, colon ? colon + 1 : "8361");
+    }
+    free(tofree);
+    if (strlen(peer_key) < 1) {
+        if (npeers > 0)
+            warnx("peers are set but peer_key is not, not joining a federation");
+        return 0;
+    }
+    return 1;
+}
+
+const char *peers_node(void)
+{
+    return node;
+}
+
+static void conn_close(struct peer_conn_t *conn)
+{
+    close(conn->fd);
+    free(conn);
+}
+
+/*!
+ * @return length of the line, or -1 on error, end of file, timeout or a
+ *   line longer than max
+ */
+static int conn_line(struct peer_conn_t *conn, char *out, int max)
+{
+    char *line, *nl;
+    int bytes, status;
+
+    while (1) {
+        line = conn->buf + conn->start;
+        nl = memchr(line, '\n', conn->len - conn->start);
+        if (nl) {
+            bytes = nl - line;
+            conn->start += bytes + 1;
+            if (bytes >= max)
+                return -1;
+            memcpy(out, line, bytes);
+            out[bytes] = '\0';
+            return bytes;
+        }
+        memmove(conn->buf, line, conn->len - conn->start);
+        conn->len -= conn->start;
+        conn->start = 0;
+        if (conn->len == sizeof(conn->buf))
+            return -1;
+        status = recv(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len, 0);
+        if (status == -1 && errno == EINTR)
+            continue;
+        else if (status <= 0)
+            return -1;
+        conn->len += status;
+    }
+}
+
+static int connect_timeout(int fd, const struct sockaddr *addr, socklen_t len)
+{
+    struct pollfd pfd;
+    socklen_t elen;
+    int flags, error;
+
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (connect(fd, addr, len) < 0) {
+        if (errno != EINPROGRESS)
+            return -1;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        error = 0;
+        elen = sizeof(error);
+        if (poll(&pfd, 1, PEER_TIMEOUT * 1000) != 1
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &elen) < 0 || error)
+            return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return 0;
+}
+
+static struct peer_conn_t *peer_connect(struct peer_t *peer)
+{
+    struct addrinfo hints, *res, *ai;
+    struct peer_conn_t *conn;
+    struct timeval tv;
+    char line[256];
+    int fd, on, len;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(peer->host, peer->port, &hints, &res) != 0)
+        return NULL;
+    fd = -1;
+    for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        // servers must not inherit it
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (connect_timeout(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        return NULL;
+    on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    tv.tv_sec = PEER_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    conn = malloc(sizeof(struct peer_conn_t));
+    if (!conn)
+        err(1, "Failed to allocate memory");
+    conn->fd = fd;
+    conn->start = conn->len = 0;
+    // KEEPALIVE keeps the peer from closing it while it waits in the pool
+    len = snprintf(line, sizeof(line), "PEER %s %s %s\nKEEPALIVE\n", node, peer_key, own_port);
+    if (send(fd, line, len, MSG_NOSIGNAL) != len || conn_line(conn, line, sizeof(line)) < 0
+        || conn_line(conn, line, sizeof(line)) < 0 || strncmp(line, "OK Node ", 8) != 0) {
+        conn_close(conn);
+        return NULL;
+    }
+    pthread_mutex_lock(&peer->lock);
+    snprintf(peer->name, sizeof(peer->name), "%.63s", line + 8);
+    pthread_mutex_unlock(&peer->lock);
+    return conn;
+}
+
+// an idle connection to the peer, or a new one
+static struct peer_conn_t *conn_take(struct peer_t *peer)
+{
+    struct peer_conn_t *conn = NULL;
+    struct pollfd pfd;
+
+    pthread_mutex_lock(&peer->lock);
+    while (!conn && peer->nidle > 0) {
+        conn = peer->idle[--peer->nidle];
+        // nothing is due on an idle connection, so if it is readable, the
+        // peer has closed it, e.g. when it was restarted
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) != 0) {
+            conn_close(conn);
+            conn = NULL;
+        }
+    }
+    pthread_mutex_unlock(&peer->lock);
+    return conn ? conn : peer_connect(peer);
+}
+
+// only a connection with nothing left to read can carry the next command
+static void conn_put(struct peer_t *peer, struct peer_conn_t *conn)
+{
+    struct pollfd pfd;
+
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    if (conn->start != conn->len || poll(&pfd, 1, 0) != 0) {
+        conn_close(conn);
+        return;
+    }
+    pthread_mutex_lock(&peer->lock);
+    if (peer->nidle < PEER_IDLE) {
+        peer->idle[peer->nidle++] = conn;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&peer->lock);
+    if (conn)
+        conn_close(conn);
+}
+
+static void peer_state(struct peer_t *peer, int up)
+{
+    char name[64];
+
+    if (peer->up == up)
+        return;
+    peer->up = up;
+    pthread_mutex_lock(&peer->lock);
+    strcpy(name, peer->name);
+    pthread_mutex_unlock(&peer->lock);
+    if (up)
+        printf("[daemon] Node %s at %s:%s is up with %d servers\n", name, peer->host, peer->port,
+               peer->nroutes);
+    else
+        printf("[daemon] Node %s at %s:%s is down\n", name, peer->host, peer->port);
+}
+
+static int compare_routes(const void *a, const void *b)
+{
+    return strcmp(((const struct route_t *) a)->id, ((const struct route_t *) b)->id);
+}
+
+static int find_route(const void *key, const void *route)
+{
+    return strcmp(key, ((const struct route_t *) route)->id);
+}
+
+static void free_routes(struct route_t *routes, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i)
+        free(routes[i].id);
+    free(routes);
+}
+
+// fetches the peer's servers and their status
+static void refresh_peer(struct peer_t *peer)
+{
+    struct peer_conn_t *conn;
+    struct route_t *routes, *grown;
+    char line[512], id[256];
+    int n, cap, status, rc;
+
+    conn = conn_take(peer);
+    if (!conn) {
+        peer_state(peer, 0);
+        return;
+    }
+    routes = NULL;
+    n = cap = 0;
+    if (send(conn->fd, "INVENTORY\n", 10, MSG_NOSIGNAL) != 10
+        || conn_line(conn, line, sizeof(line)) < 0 || strcmp(line, REPLY_START) != 0) {
+        conn_close(conn);
+        peer_state(peer, 0);
+        return;
+    }
+    while ((rc = conn_line(conn, line, sizeof(line))) >= 0 && strcmp(line, REPLY_END) != 0) {
+        if (sscanf(line, "%255s %d", id, &status) != 2)
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            grown = realloc(routes, cap * sizeof(struct route_t));
+            if (!grown)
+                err(1, "Failed to allocate memory");
+            routes = grown;
+        }
+        routes[n].id = strdup(id);
+        if (!routes[n].id)
+            err(1, "Failed to allocate memory");
+        routes[n++].status = status;
+    }
+    if (rc < 0) {
+        conn_close(conn);
+        free_routes(routes, n);
+        peer_state(peer, 0);
+        return;
+    }
+    conn_put(peer, conn);
+    qsort(routes, n, sizeof(struct route_t), compare_routes);
+    pthread_rwlock_wrlock(&table_lock);
+    grown = peer->routes;
+    rc = peer->nroutes;
+    peer->routes = routes;
+    peer->nroutes = n;
+    pthread_rwlock_unlock(&table_lock);
+    free_routes(grown, rc);
+    peer_state(peer, 1);
+}
+
+/*!
+ * @param all also the peers that were down, which may take PEER_TIMEOUT
+ *   each to give up on
+ */
+static void refresh_all(int all)
+{
+    struct peer_t *peer;
+    int i;
+
+    for (i = 0; (peer = peer_at(i)); ++i)
+        if (all || peer->up)
+            refresh_peer(peer);
+}
+
+void *peers_loop(void *ptr)
+{
+    struct timespec due;
+    int all;
+
+    clock_gettime(CLOCK_REALTIME, &due);
+    while (1) {
+        all = 0;
+        pthread_mutex_lock(&wake_lock);
+        while (!missed && !all)
+            all = pthread_cond_timedwait(&wake_cond, &wake_lock, &due) == ETIMEDOUT;
+        missed = 0;
+        pthread_mutex_unlock(&wake_lock);
+        if (all) {
+            refresh_all(1);
+            clock_gettime(CLOCK_REALTIME, &due);
+            due.tv_sec += refresh_secs;
+        } else {
+            // a peer that is down would hold up the others until the next round
+            refresh_all(0);
+            // once a second at most, however many logins miss
+            sleep(1);
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * PEER <node> <key> <port>, another node logging in. One that isn't in
+ * our list yet is added to it, at the address it came from.
+ * @return 1 if the key is the peer_key
+ */
+int peers_login(int fd, const char *args)
+{
+    struct sockaddr_storage ss;
+    socklen_t slen = sizeof(ss);
+    char name[64], key[256], port[16], host[NI_MAXHOST];
+    int i, known;
+
+    if (strlen(peer_key) < 1 || sscanf(args, "%63s %255s %15s", name, key, port) != 3
+        || strcmp(key, peer_key) != 0)
+        return 0;
+    if (strcmp(name, node) == 0 || getpeername(fd, (struct sockaddr *) &ss, &slen) < 0
+        || getnameinfo((struct sockaddr *) &ss, slen, host, sizeof(host), NULL, 0,
+                       NI_NUMERICHOST) != 0)
+        return 1;
+    known = 0;
+    pthread_rwlock_rdlock(&table_lock);
+    for (i = 0; i < npeers && !known; ++i) {
+        pthread_mutex_lock(&peers[i]->lock);
+        known = strcmp(peers[i]->name, name) == 0
+            || (strcmp(peers[i]->host, host) == 0 && strcmp(peers[i]->port, port) == 0);
+        pthread_mutex_unlock(&peers[i]->lock);
+    }
+    pthread_rwlock_unlock(&table_lock);
+    if (!known) {
+        printf("[daemon] Node %s joined from %s:%s\n", name, host, port);
+        // refreshed with the others from the next round on
+        peer_add(host, port);
+    }
+    return 1;
+}
+
+static struct peer_t *lookup(const char *server)
+{
+    struct peer_t *peer = NULL;
+    int i;
+
+    pthread_rwlock_rdlock(&table_lock);
+    for (i = 0; i < npeers && !peer; ++i)
+        if (bsearch(server, peers[i]->routes, peers[i]->nroutes, sizeof(struct route_t),
+                    find_route))
+            peer = peers[i];
+    pthread_rwlock_unlock(&table_lock);
+    return peer;
+}
+
+/*!
+ * @return the peer that runs server, or NULL if none does as of the last
+ *   refresh
+ */
+struct peer_t *peers_route(const char *server)
+{
+    struct peer_t *peer;
+
+    peer = lookup(server);
+    if (!peer && npeers > 0) {
+        // a server that was just added on its node isn't in the table yet
+        pthread_mutex_lock(&wake_lock);
+        missed = 1;
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+    return peer;
+}
+
+/*!
+ * Copies one reply to out as it comes in, the length given by the
+ * REPLY_FORWARD line in front of it.
+ * @return 1 for an OK reply, 0 for ERR, or -1 if the connection failed
+ */
+static int relay(struct peer_conn_t *conn, int out)
+{
+    char line[64];
+    long long left;
+    int first, ok, chunk, status;
+
+    if (conn_line(conn, line, sizeof(line)) < 0 || sscanf(line, REPLY_FORWARD, &left) != 1
+        || left < 0)
+        return -1;
+    first = 1;
+    ok = 0;
+    while (1) {
+        chunk = conn->len - conn->start;
+        if (chunk > left)
+            chunk = left;
+        // a reply starts with OK or ERR
+        if (first && chunk > 0) {
+            first = 0;
+            ok = conn->buf[conn->start] == 'O';
+        }
+        // if the client is gone, the rest is still read to keep the connection usable
+        send(out, conn->buf + conn->start, chunk, MSG_NOSIGNAL);
+        conn->start += chunk;
+        left -= chunk;
+        if (left == 0)
+            return ok;
+        conn->start = conn->len = 0;
+        status = recv(conn->fd, conn->buf, sizeof(conn->buf), 0);
+        if (status == -1 && errno == EINTR)
+            continue;
+        else if (status <= 0)
+            return -1;
+        conn->len += status;
+    }
+}
+
+/*!
+ * Runs a command for a server on the peer, which sends the reply to out.
+ * @param key the client's key, checked by the peer
+ * @return 1 if the peer answered OK, 0 for ERR, or -1 if it couldn't be
+ *   reached or stopped answering, after which the client needs to be told
+ */
+int peers_forward(struct peer_t *peer, const char *server, const char *key,
+                  const char *command, int out)
+{
+    struct peer_conn_t *conn;
+    char line[1024];
+    long long begin;
+    int len, rc;
+
+    begin = trace_now();
+    len = snprintf(line, sizeof(line), "FORWARD %s %s %s\n", server, key, command);
+    if (len >= sizeof(line))
+        return -1;
+    conn = conn_take(peer);
+    if (!conn) {
+        peer_state(peer, 0);
+        return -1;
+    }
+    rc = send(conn->fd, line, len, MSG_NOSIGNAL) == len ? relay(conn, out) : -1;
+    if (rc < 0) {
+        conn_close(conn);
+        peer_state(peer, 0);
+        return -1;
+    }
+    conn_put(peer, conn);
+    // the extra hop, from here until the whole reply is passed on
+    trace_record("forward", NULL, begin);
+    return rc;
+}
+
+/*!
+ * Sends "<server> <node> <status>" for the servers on other nodes, with
+ * -1 for the status of those on a node that is down.
+ */
+void peers_list(int fd)
+{
+    struct peer_t *peer;
+    char name[64], msg[512];
+    int i, j, len;
+
+    pthread_rwlock_rdlock(&table_lock);
+    for (i = 0; i < npeers; ++i) {
+        peer = peers[i];
+        pthread_mutex_lock(&peer->lock);
+        strcpy(name, peer->name);
+        pthread_mutex_unlock(&peer->lock);
+        for (j = 0; j < peer->nroutes; ++j) {
+            len = snprintf(msg, sizeof(msg), "%s %s %d\n", peer->routes[j].id, name,
+                           peer->up ? peer->routes[j].status : -1);
+            write(fd, msg, len);
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+}
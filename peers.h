@@ -0,0 +1,22 @@
+//
+//  peers.h
+//  mcmdd
+//
+//  Other mcmdd nodes, and which servers each of them runs.
+//
+
+#ifndef mcmdd_peers_h
+#define mcmdd_peers_h
+
+struct peer_t;
+
+int peers_init(void);
+void *peers_loop(void *ptr);
+const char *peers_node(void);
+int peers_login(int fd, const char *args);
+struct peer_t *peers_route(const char *server);
+int peers_forward(struct peer_t *peer, const char *server, const char *key,
+                  const char *command, int out);
+void peers_list(int fd);
+
+#endif
@@ -0,0 +1,352 @@
+//
+//  placement.c
+//  mcmdd
+//
+//  Servers can be pinned to a set of cores, bound to NUMA memory nodes and
+//  given a nice level and I/O priority. All of it is set up in the child
+//  between fork() and execvp() and inherited by the JVM. With cpus=auto,
+//  each server is handed cores no other server is using when it starts,
+//  taken from a single NUMA node where possible.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#endif
+
+#include "placement.h"
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+#define CPU_BIT(set, cpu) ((set)[(cpu) / WORD_BITS] & (1UL << ((cpu) % WORD_BITS)))
+#define CPU_ON(set, cpu) ((set)[(cpu) / WORD_BITS] |= 1UL << ((cpu) % WORD_BITS))
+#define CPU_OFF(set, cpu) ((set)[(cpu) / WORD_BITS] &= ~(1UL << ((cpu) % WORD_BITS)))
+
+// constants from linux/mempolicy.h and linux/ioprio.h
+#define MPOL_PREFERRED_ 1
+#define MPOL_BIND_ 2
+#define MPOL_INTERLEAVE_ 3
+#define IOPRIO_WHO_PROCESS_ 1
+#define IOPRIO_CLASS_SHIFT_ 13
+#define MAX_NODES 64
+
+// cores handed out by cpus=auto, shared by all servers
+static pthread_mutex_t auto_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long auto_used[PLACEMENT_WORDS];
+
+/*!
+ * Parses a list like "0-3,8,10-11".
+ * @return 0 on success
+ */
+static int parse_list(const char *list, unsigned long *set, int max)
+{
+    const char *p;
+    char *end;
+    long from, to;
+
+    memset(set, 0, sizeof(unsigned long) * ((max + WORD_BITS - 1) / WORD_BITS));
+    for (p = list; *p; ) {
+        from = strtol(p, &end, 10);
+        if (end == p || from < 0)
+            return -1;
+        to = from;
+        if (*end == '-') {
+            p = end + 1;
+            to = strtol(p, &end, 10);
+            if (end == p || to < from)
+                return -1;
+        }
+        if (to >= max)
+            return -1;
+        for (; from <= to; ++from)
+            CPU_ON(set, from);
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+    return 0;
+}
+
+static void format_list(const unsigned long *set, int max, char *out, size_t len)
+{
+    int i, from;
+    size_t used;
+
+    out[0] = '\0';
+    used = 0;
+    for (i = 0; i < max && used < len; ) {
+        if (!CPU_BIT(set, i)) {
+            ++i;
+            continue;
+        }
+        from = i;
+        while (i < max && CPU_BIT(set, i))
+            ++i;
+        if (from == i - 1)
+            used += snprintf(out + used, len - used, "%s%d", used ? "," : "", from);
+        else
+            used += snprintf(out + used, len - used, "%s%d-%d", used ? "," : "", from, i - 1);
+    }
+    if (!out[0])
+        snprintf(out, len, "-");
+}
+
+int placement_init(struct server_t *server, const char *cpus, const char *numa,
+                   const char *nice, const char *ionice)
+{
+    struct placement_t *placement;
+    const char *nodes;
+
+    if (!cpus[0] && !numa[0] && !nice[0] && !ionice[0])
+        return 0;
+    placement = calloc(1, sizeof(struct placement_t));
+    if (!placement)
+        err(1, "Failed to allocate memory");
+    server->placement = placement;
+    if (strcmp(cpus, "auto") == 0 || strncmp(cpus, "auto:", 5) == 0) {
+        placement->auto_cpus = cpus[4] ? atoi(cpus + 5) : 1;
+        if (placement->auto_cpus < 1)
+            return -1;
+    } else if (cpus[0]) {
+        if (parse_list(cpus, placement->cpus, PLACEMENT_MAXCPUS) < 0)
+            return -1;
+        placement->has_cpus = 1;
+    }
+    nodes = strchr(numa, ':');
+    if (strcmp(numa, "auto") == 0)
+        placement->numa = NUMA_AUTO;
+    else if (strncmp(numa, "bind:", 5) == 0)
+        placement->numa = NUMA_BIND;
+    else if (strncmp(numa, "preferred:", 10) == 0)
+        placement->numa = NUMA_PREFERRED;
+    else if (strncmp(numa, "interleave:", 11) == 0)
+        placement->numa = NUMA_INTERLEAVE;
+    else if (numa[0])
+        return -1;
+    if (placement->numa != NUMA_NONE && placement->numa != NUMA_AUTO
+        && parse_list(nodes + 1, &placement->nodes, MAX_NODES) < 0)
+        return -1;
+    if (nice[0]) {
+        placement->has_nice = 1;
+        placement->nice = atoi(nice);
+    }
+    if (strcmp(ionice, "idle") == 0) {
+        placement->ioclass = 3;
+    } else if (strncmp(ionice, "realtime:", 9) == 0) {
+        placement->ioclass = 1;
+        placement->iolevel = atoi(ionice + 9);
+    } else if (strncmp(ionice, "best-effort:", 12) == 0) {
+        placement->ioclass = 2;
+        placement->iolevel = atoi(ionice + 12);
+    } else if (ionice[0]) {
+        return -1;
+    }
+    if (placement->iolevel < 0 || placement->iolevel > 7)
+        return -1;
+    return 0;
+}
+
+void placement_free(struct server_t *server)
+{
+    free(server->placement);
+    server->placement = NULL;
+}
+
+/*!
+ * Reads the cores of a NUMA node, node 0 being every online core on
+ * machines without NUMA information.
+ * @return 0 on success, -1 if there is no such node
+ */
+static int node_cpus(int node, unsigned long *set)
+{
+    char path[128], buf[1024];
+    FILE *file;
+    long i, n;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    file = fopen(path, "r");
+    if (file) {
+        if (!fgets(buf, sizeof(buf), file))
+            buf[0] = '\0';
+        fclose(file);
+        buf[strcspn(buf, "\n")] = '\0';
+        return parse_list(buf, set, PLACEMENT_MAXCPUS);
+    }
+    if (node > 0 || access("/sys/devices/system/node/node0", F_OK) == 0)
+        return -1;
+    memset(set, 0, sizeof(unsigned long) * PLACEMENT_WORDS);
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < n && i < PLACEMENT_MAXCPUS; ++i)
+        CPU_ON(set, i);
+    return 0;
+}
+
+void placement_acquire(struct server_t *server)
+{
+    struct placement_t *placement = server->placement;
+    unsigned long cpus[PLACEMENT_WORDS];
+    int node, best, best_free, free_cpus, i, want;
+    char list[256];
+
+    if (!placement || !placement->auto_cpus || placement->held)
+        return;
+    want = placement->auto_cpus;
+    pthread_mutex_lock(&auto_lock);
+    // the node with the most free cores, so a server stays on one node
+    best = -1;
+    best_free = 0;
+    for (node = 0; node < MAX_NODES && node_cpus(node, cpus) == 0; ++node) {
+        for (free_cpus = 0, i = 0; i < PLACEMENT_MAXCPUS; ++i)
+            if (CPU_BIT(cpus, i) && !CPU_BIT(auto_used, i))
+                free_cpus++;
+        if (free_cpus > best_free) {
+            best = node;
+            best_free = free_cpus;
+        }
+    }
+    memset(placement->cpus, 0, sizeof(placement->cpus));
+    placement->has_cpus = 0;
+    if (best >= 0) {
+        node_cpus(best, cpus);
+        for (i = 0; i < PLACEMENT_MAXCPUS && want > 0; ++i) {
+            if (CPU_BIT(cpus, i) && !CPU_BIT(auto_used, i)) {
+                CPU_ON(placement->cpus, i);
+                CPU_ON(auto_used, i);
+                want--;
+            }
+        }
+        placement->has_cpus = 1;
+        placement->held = 1;
+        if (placement->numa == NUMA_AUTO)
+            placement->nodes = 1UL << best;
+    }
+    pthread_mutex_unlock(&auto_lock);
+    if (!placement->has_cpus) {
+        printf("[%s] No free cores left, running unpinned.\n", server->id);
+        return;
+    }
+    format_list(placement->cpus, PLACEMENT_MAXCPUS, list, sizeof(list));
+    printf("[%s] Placed on cores %s of node %d%s.\n", server->id, list, best,
+           want > 0 ? " (fewer than asked for)" : "");
+}
+
+void placement_release(struct server_t *server)
+{
+    struct placement_t *placement = server->placement;
+    int i;
+
+    if (!placement || !placement->held)
+        return;
+    pthread_mutex_lock(&auto_lock);
+    for (i = 0; i < PLACEMENT_MAXCPUS; ++i)
+        if (CPU_BIT(placement->cpus, i))
+            CPU_OFF(auto_used, i);
+    pthread_mutex_unlock(&auto_lock);
+    memset(placement->cpus, 0, sizeof(placement->cpus));
+    placement->has_cpus = 0;
+    placement->held = 0;
+}
+
+#ifdef __linux__
+static void cpu_set_of(const struct placement_t *placement, cpu_set_t *set)
+{
+    int i;
+
+    CPU_ZERO(set);
+    for (i = 0; i < PLACEMENT_MAXCPUS && i < CPU_SETSIZE; ++i)
+        if (CPU_BIT(placement->cpus, i))
+            CPU_SET(i, set);
+}
+#endif
+
+/*!
+ * Runs in the forked child. Failures end up on the server's console and
+ * don't stop it from launching.
+ */
+void placement_apply(const struct placement_t *placement)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    int mode;
+
+    if (!placement)
+        return;
+    if (placement->has_cpus) {
+        cpu_set_of(placement, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            warn("sched_setaffinity");
+    }
+    mode = placement->numa == NUMA_PREFERRED ? MPOL_PREFERRED_
+         : placement->numa == NUMA_INTERLEAVE ? MPOL_INTERLEAVE_ : MPOL_BIND_;
+    if (placement->numa != NUMA_NONE && placement->nodes
+        && syscall(SYS_set_mempolicy, mode, &placement->nodes, MAX_NODES + 1) < 0)
+        warn("set_mempolicy");
+    if (placement->ioclass
+        && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS_, 0,
+                   placement->ioclass << IOPRIO_CLASS_SHIFT_ | placement->iolevel) < 0)
+        warn("ioprio_set");
+#endif
+    if (placement && placement->has_nice && setpriority(PRIO_PROCESS, 0, placement->nice) < 0)
+        warn("setpriority");
+}
+
+/*!
+ * Moves every thread of a process that is already running onto the
+ * placement's cores, for a hot spare started while others held them.
+ * Memory policy and priorities can't be changed from outside and stay as
+ * the spare was started with.
+ */
+void placement_pin(const struct placement_t *placement, pid_t pid)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    char path[64];
+    DIR *dir;
+    struct dirent *entry;
+
+    if (!placement || !placement->has_cpus)
+        return;
+    cpu_set_of(placement, &set);
+    snprintf(path, sizeof(path), "/proc/%d/task", (int) pid);
+    dir = opendir(path);
+    if (!dir) {
+        if (sched_setaffinity(pid, sizeof(set), &set) < 0)
+            warn("sched_setaffinity");
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.'
+            && sched_setaffinity(atoi(entry->d_name), sizeof(set), &set) < 0)
+            warn("sched_setaffinity");
+    closedir(dir);
+#endif
+}
+
+void placement_describe(struct server_t *server, char *out, size_t len)
+{
+    struct placement_t *placement = server->placement;
+    static const char *numa_names[] = { "none", "bind", "preferred", "interleave", "bind" };
+    static const char *io_names[] = { "none", "realtime", "best-effort", "idle" };
+    char cpus[256], nodes[128];
+
+    if (!placement) {
+        snprintf(out, len, "- none - 0 none 0");
+        return;
+    }
+    format_list(placement->cpus, PLACEMENT_MAXCPUS, cpus, sizeof(cpus));
+    format_list(&placement->nodes, MAX_NODES, nodes, sizeof(nodes));
+    // cores, memory policy and nodes, nice level, I/O class and level
+    snprintf(out, len, "%s %s %s %d %s %d", cpus, numa_names[placement->numa], nodes,
+             placement->has_nice ? placement->nice : 0, io_names[placement->ioclass],
+             placement->iolevel);
+}
@@ -0,0 +1,48 @@
+//
+//  placement.h
+//  mcmdd
+//
+//  CPU, NUMA memory and scheduling placement of server processes.
+//
+
+#ifndef mcmdd_placement_h
+#define mcmdd_placement_h
+
+#include <stddef.h>
+
+#include "server.h"
+
+#define PLACEMENT_MAXCPUS 1024
+#define PLACEMENT_WORDS (PLACEMENT_MAXCPUS / (8 * sizeof(unsigned long)))
+
+enum numa_mode_t {
+    NUMA_NONE = 0,
+    NUMA_BIND,
+    NUMA_PREFERRED,
+    NUMA_INTERLEAVE,
+    // bind to the node the automatic cores were taken from
+    NUMA_AUTO
+};
+
+struct placement_t {
+    // number of cores to hand out automatically, 0 for a fixed set
+    int auto_cpus;
+    int has_cpus, held;
+    unsigned long cpus[PLACEMENT_WORDS];
+    enum numa_mode_t numa;
+    unsigned long nodes;
+    int has_nice, nice;
+    // I/O scheduling class (1 realtime, 2 best-effort, 3 idle), 0 to inherit
+    int ioclass, iolevel;
+};
+
+int placement_init(struct server_t *server, const char *cpus, const char *numa,
+                   const char *nice, const char *ionice);
+void placement_acquire(struct server_t *server);
+void placement_release(struct server_t *server);
+void placement_apply(const struct placement_t *placement);
+void placement_pin(const struct placement_t *placement, pid_t pid);
+void placement_describe(struct server_t *server, char *out, size_t len);
+void placement_free(struct server_t *server);
+
+#endif
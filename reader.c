@@ -0,0 +1,368 @@
+//
+//  reader.c
+//  mcmdd
+//
+//  With hundreds of servers, a thread blocked in read() on every console
+//  pipe means a wakeup and two context switches per chunk of output, per
+//  server. Instead, a server's thread hands its pipe to reader_wait() and
+//  sleeps until the server closes it, while one reader thread reads every
+//  pipe and splits the output into lines for process_line().
+//
+//  The reader uses io_uring where the kernel allows it (it is often
+//  disabled by sysctl or a seccomp filter), and epoll otherwise. With
+//  io_uring every pipe has a read queued into its own slot of one
+//  registered buffer, and the completions are reaped and the reads queued
+//  again with a single io_uring_enter() per batch. Pipes can't take
+//  multishot reads before Linux 6.7, so each read is queued again
+//  when it completes.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "reader.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#define READER_SLOT 16384
+#define READER_EVENTS 64
+
+struct reader_pipe_t {
+    struct server_t *server;
+    int fd, slot, done;
+    pthread_cond_t cond;
+    // the line being put together, across reads
+    char line[SERVER_LINEMAX];
+    int sp;
+};
+
+static enum reader_backend_t backend = READER_THREADS;
+// guards the slots, the done flags and the submission queue
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *slab;
+static int *free_slots, nfree;
+
+static const char *backend_names[] = { "threads", "epoll", "io_uring" };
+
+#ifdef __linux__
+
+static int epfd = -1;
+
+static int ring_fd = -1, fixed;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+// queued in the ring but not yet submitted to the kernel
+static unsigned unsubmitted;
+
+// whether the kernel has op, which io_uring_setup() alone doesn't tell
+static int ring_supports(int op)
+{
+    struct io_uring_probe *probe;
+    int ok;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (!probe)
+        err(1, "Failed to allocate memory");
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        // before 5.6 there is no probe, and of the reads only the fixed one
+        ok = op == IORING_OP_READ_FIXED;
+    else
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static int ring_setup(int pipes)
+{
+    struct io_uring_params p;
+    struct iovec *iov;
+    unsigned entries;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    int i;
+
+    // at most one read per pipe is ever in flight
+    for (entries = 64; entries < pipes; entries *= 2)
+        ;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring_fd < 0)
+        return -1;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+              IORING_OFF_SQ_RING);
+    cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq
+        : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+               IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    sq_head = (unsigned *) (sq + p.sq_off.head);
+    sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *) (sq + p.sq_off.array);
+    cq_head = (unsigned *) (cq + p.cq_off.head);
+    cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // registered, the kernel maps the slots once instead of on every read.
+    // old kernels count that against RLIMIT_MEMLOCK, so it may not work
+    iov = malloc(pipes * sizeof(struct iovec));
+    if (!iov)
+        err(1, "Failed to allocate memory");
+    for (i = 0; i < pipes; ++i) {
+        iov[i].iov_base = slab + i * READER_SLOT;
+        iov[i].iov_len = READER_SLOT;
+    }
+    fixed = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, pipes) == 0;
+    free(iov);
+    // a read the kernel doesn't know fails with -EINVAL, which would look
+    // like the end of every console
+    if (!ring_supports(fixed ? IORING_OP_READ_FIXED : IORING_OP_READ)) {
+        munmap(sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        if (cq != sq)
+            munmap(cq, cq_size);
+        munmap(sq, sq_size);
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// with the lock held
+static void ring_queue_read(struct reader_pipe_t *pipe)
+{
+    unsigned tail = *sq_tail, index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = pipe->fd;
+    sqe->off = (unsigned long long) -1;
+    sqe->addr = (unsigned long) (slab + pipe->slot * READER_SLOT);
+    sqe->len = READER_SLOT;
+    sqe->buf_index = pipe->slot;
+    sqe->user_data = (unsigned long) pipe;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+}
+
+// with the lock held
+static int ring_submit(unsigned wait)
+{
+    unsigned count = unsubmitted;
+    int rc;
+
+    unsubmitted = 0;
+    if (wait)
+        pthread_mutex_unlock(&lock);
+    rc = syscall(__NR_io_uring_enter, ring_fd, count, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                 NULL, 0);
+    if (wait)
+        pthread_mutex_lock(&lock);
+    // interrupted before it got to them, they go with the next call
+    if (rc < (int) count)
+        unsubmitted += count - (rc < 0 ? 0 : rc);
+    return rc;
+}
+
+static int epoll_setup(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    return epfd < 0 ? -1 : 0;
+}
+
+#endif
+
+/*!
+ * Picks the backend, io_uring if it works here and then epoll for "auto".
+ * @param pipes the most pipes that will be read at once
+ */
+enum reader_backend_t reader_init(const char *name, int pipes)
+{
+    int i;
+
+    if (pipes < 1 || strcmp(name, "threads") == 0)
+        return backend = READER_THREADS;
+#ifdef __linux__
+    slab = mmap(NULL, (size_t) pipes * READER_SLOT, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    free_slots = malloc(pipes * sizeof(int));
+    if (slab == MAP_FAILED || !free_slots)
+        err(1, "Failed to allocate memory");
+    // servers don't need it, and fork() would have to copy registered
+    // (pinned) pages up front for every one of them
+    madvise(slab, (size_t) pipes * READER_SLOT, MADV_DONTFORK);
+    for (i = 0; i < pipes; ++i)
+        free_slots[i] = pipes - 1 - i;
+    nfree = pipes;
+    if (strcmp(name, "epoll") != 0 && ring_setup(pipes) == 0)
+        backend = READER_IO_URING;
+    else if (strcmp(name, "io_uring") != 0 && epoll_setup() == 0)
+        backend = READER_EPOLL;
+    else
+        warnx("No %s here, servers read their own consoles", name);
+#else
+    (void) i;
+#endif
+    return backend;
+}
+
+const char *reader_backend_name(void)
+{
+    return backend_names[backend];
+}
+
+// with the lock held
+static void finish(struct reader_pipe_t *pipe)
+{
+    free_slots[nfree++] = pipe->slot;
+    pipe->done = 1;
+    // the waiting thread owns pipe again from here
+    pthread_cond_signal(&pipe->cond);
+}
+
+/*!
+ * Reads the server's console on the reader thread until the end of file.
+ * @return 0 once the pipe is closed, or -1 if there is no reader thread
+ *   (or no slot free), in which case the caller reads it itself
+ */
+int reader_wait(struct server_t *server, int fd)
+{
+    struct reader_pipe_t pipe;
+
+    if (backend == READER_THREADS)
+        return -1;
+    pipe.server = server;
+    pipe.fd = fd;
+    pipe.done = 0;
+    pipe.sp = 0;
+    pthread_cond_init(&pipe.cond, NULL);
+    pthread_mutex_lock(&lock);
+    if (nfree == 0) {
+        pthread_mutex_unlock(&lock);
+        pthread_cond_destroy(&pipe.cond);
+        return -1;
+    }
+    pipe.slot = free_slots[--nfree];
+#ifdef __linux__
+    if (backend == READER_IO_URING) {
+        ring_queue_read(&pipe);
+        ring_submit(0);
+    } else {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &pipe;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            free_slots[nfree++] = pipe.slot;
+            pthread_mutex_unlock(&lock);
+            pthread_cond_destroy(&pipe.cond);
+            return -1;
+        }
+    }
+#endif
+    while (!pipe.done)
+        pthread_cond_wait(&pipe.cond, &lock);
+    pthread_mutex_unlock(&lock);
+    pthread_cond_destroy(&pipe.cond);
+    return 0;
+}
+
+#ifdef __linux__
+
+static void ring_loop(void)
+{
+    struct io_uring_cqe *cqe;
+    struct reader_pipe_t *pipe;
+    unsigned head;
+    int res;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        // queue the reads again and wait for the next completions in one go
+        if (ring_submit(1) < 0 && errno != EINTR && errno != EBUSY)
+            err(1, "io_uring_enter");
+        head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &cqes[head & *cq_mask];
+            pipe = (struct reader_pipe_t *) (unsigned long) cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            if (res > 0) {
+                // lines are handled without the lock, only this thread touches the slot
+                pthread_mutex_unlock(&lock);
+                server_read(pipe->server, slab + pipe->slot * READER_SLOT, res, pipe->line, &pipe->sp);
+                pthread_mutex_lock(&lock);
+                ring_queue_read(pipe);
+            } else if (res == -EINTR || res == -EAGAIN) {
+                ring_queue_read(pipe);
+            } else {
+                finish(pipe);
+            }
+        }
+    }
+}
+
+static void epoll_loop(void)
+{
+    struct epoll_event events[READER_EVENTS];
+    struct reader_pipe_t *pipe;
+    ssize_t n;
+    int count, i;
+
+    while (1) {
+        count = epoll_wait(epfd, events, READER_EVENTS, -1);
+        if (count < 0 && errno == EINTR)
+            continue;
+        else if (count < 0)
+            err(1, "epoll_wait");
+        for (i = 0; i < count; ++i) {
+            pipe = events[i].data.ptr;
+            // readable or hung up, so this doesn't block
+            n = read(pipe->fd, slab + pipe->slot * READER_SLOT, READER_SLOT);
+            if (n > 0) {
+                server_read(pipe->server, slab + pipe->slot * READER_SLOT, n, pipe->line, &pipe->sp);
+            } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, pipe->fd, NULL);
+                pthread_mutex_lock(&lock);
+                finish(pipe);
+                pthread_mutex_unlock(&lock);
+            }
+        }
+    }
+}
+
+#endif
+
+void *reader_loop(void *ptr)
+{
+#ifdef __linux__
+    if (backend == READER_IO_URING)
+        ring_loop();
+    else if (backend == READER_EPOLL)
+        epoll_loop();
+#endif
+    return NULL;
+}
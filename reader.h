@@ -0,0 +1,25 @@
+//
+//  reader.h
+//  mcmdd
+//
+//  Console output of all servers, read by a single thread.
+//
+
+#ifndef mcmdd_reader_h
+#define mcmdd_reader_h
+
+#include "server.h"
+
+enum reader_backend_t {
+    // every server thread reads its own pipe
+    READER_THREADS = 0,
+    READER_EPOLL,
+    READER_IO_URING
+};
+
+enum reader_backend_t reader_init(const char *backend, int pipes);
+const char *reader_backend_name(void);
+int reader_wait(struct server_t *server, int fd);
+void *reader_loop(void *ptr);
+
+#endif
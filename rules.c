@@ -0,0 +1,240 @@
+//
+//  rules.c
+//  mcmdd
+//
+//  Console rules have the form "<text> => <action> [argument]". All of a
+//  server's patterns are compiled into one Aho-Corasick automaton, so each
+//  console line is scanned once no matter how many rules there are.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "rules.h"
+#include "telemetry.h"
+#include "trace.h"
+#include "statpage.h"
+#include "events.h"
+#include "cds.h"
+
+static const char *action_names[] = {
+    "status", "exec", "restart", "event", "count", "sample"
+};
+
+const char *rules_action_name(enum rule_action_t action)
+{
+    return action_names[action];
+}
+
+struct rules_t *rules_new(void)
+{
+    struct rules_t *rules = calloc(1, sizeof(struct rules_t));
+    if (!rules)
+        err(1, "Failed to allocate memory");
+    return rules;
+}
+
+/*!
+ * @return 0 if the rule was added, -1 if it could not be parsed
+ */
+int rules_add(struct rules_t *rules, const char *spec)
+{
+    const char *sep, *action, *arg;
+    struct rule_t *rule;
+    size_t i, len;
+
+    sep = strstr(spec, " => ");
+    if (!sep || sep == spec)
+        return -1;
+    action = sep + 4;
+    arg = strchr(action, ' ');
+    len = arg ? (size_t) (arg - action) : strlen(action);
+    for (i = 0; i < sizeof(action_names) / sizeof(action_names[0]); ++i)
+        if (strlen(action_names[i]) == len && strncmp(action_names[i], action, len) == 0)
+            break;
+    if (i == sizeof(action_names) / sizeof(action_names[0]))
+        return -1;
+    if (arg)
+        arg++;
+    if ((i == RULE_STATUS && (!arg || strcmp(arg, "running") != 0))
+        || ((i == RULE_EXEC || i == RULE_EVENT) && (!arg || !arg[0]))
+        || (i == RULE_SAMPLE && (!arg || (strcmp(arg, "lag") != 0
+                                          && strcmp(arg, "tps") != 0
+                                          && strcmp(arg, "gc") != 0
+                                          && strcmp(arg, "players") != 0))))
+        return -1;
+    if (rules->len >= rules->max) {
+        rules->max = rules->max ? rules->max * 2 : 8;
+        rules->rules = realloc(rules->rules, sizeof(struct rule_t) * rules->max);
+        if (!rules->rules)
+            err(1, "Failed to allocate memory");
+    }
+    rule = &rules->rules[rules->len++];
+    rule->pattern = strndup(spec, sep - spec);
+    rule->action = i;
+    rule->arg = NULL;
+    if (i == RULE_EXEC) {
+        // console commands need their newline
+        rule->arg = malloc(strlen(arg) + 2);
+        sprintf(rule->arg, "%s\n", arg);
+    } else if (arg) {
+        rule->arg = strdup(arg);
+    }
+    rule->hits = 0;
+    rule->next = -1;
+    rule->seen = 0;
+    return 0;
+}
+
+void rules_compile(struct rules_t *rules)
+{
+    int i, a, s, t, n, maxstates, head, tail;
+    int *fail, *queue;
+    const unsigned char *p;
+
+    // every byte that appears in a pattern gets its own class, the rest
+    // share class 0 which always leads back to the root
+    memset(rules->classes, 0, sizeof(rules->classes));
+    n = 1;
+    maxstates = 1;
+    for (i = 0; i < rules->len; ++i) {
+        for (p = (const unsigned char *) rules->rules[i].pattern; *p; ++p, ++maxstates)
+            if (!rules->classes[*p])
+                rules->classes[*p] = n++;
+    }
+    rules->nclasses = n;
+    free(rules->delta);
+    free(rules->out);
+    free(rules->dict);
+    rules->delta = malloc(sizeof(int) * maxstates * n);
+    rules->out = malloc(sizeof(int) * maxstates);
+    rules->dict = calloc(maxstates, sizeof(int));
+    fail = calloc(maxstates, sizeof(int));
+    queue = malloc(sizeof(int) * maxstates);
+    if (!rules->delta || !rules->out || !rules->dict || !fail || !queue)
+        err(1, "Failed to allocate memory");
+    for (i = 0; i < maxstates * n; ++i)
+        rules->delta[i] = -1;
+    for (i = 0; i < maxstates; ++i)
+        rules->out[i] = -1;
+
+    // trie of all patterns
+    rules->nstates = 1;
+    for (i = 0; i < rules->len; ++i) {
+        s = 0;
+        for (p = (const unsigned char *) rules->rules[i].pattern; *p; ++p) {
+            a = rules->classes[*p];
+            if (rules->delta[s * n + a] < 0)
+                rules->delta[s * n + a] = rules->nstates++;
+            s = rules->delta[s * n + a];
+        }
+        rules->rules[i].next = rules->out[s];
+        rules->out[s] = i;
+    }
+
+    // breadth first, turning failure links into direct transitions
+    head = tail = 0;
+    for (a = 0; a < n; ++a) {
+        t = rules->delta[a];
+        if (t < 0) {
+            rules->delta[a] = 0;
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        for (a = 0; a < n; ++a) {
+            t = rules->delta[s * n + a];
+            if (t < 0) {
+                rules->delta[s * n + a] = rules->delta[fail[s] * n + a];
+                continue;
+            }
+            fail[t] = rules->delta[fail[s] * n + a];
+            rules->dict[t] = rules->out[fail[t]] >= 0 ? fail[t] : rules->dict[fail[t]];
+            queue[tail++] = t;
+        }
+    }
+    free(fail);
+    free(queue);
+}
+
+static void rules_fire(struct rule_t *rule, struct server_t *server, const char *line)
+{
+    rule->hits++;
+    switch (rule->action) {
+        case RULE_STATUS:
+            if (server->status == STATUS_STARTING) {
+                server->status = STATUS_RUNNING;
+                // from spawning until the server says it is done loading
+                if (server->start_begin) {
+                    trace_record("start", server->id, server->start_begin);
+                    if (server->cds)
+                        cds_started(server, (trace_now() - server->start_begin) / 1000000);
+                }
+                server->start_begin = 0;
+                statpage_update(server);
+                events_post(server->id, "running", "%ld", (long) (time(NULL) - server->start));
+            }
+            break;
+        case RULE_EXEC:
+            server_send(server, rule->arg);
+            break;
+        case RULE_RESTART:
+            if (server->status == STATUS_RUNNING || server->status == STATUS_STARTING) {
+                printf("[%s] Restarting on \"%s\".\n", server->id, rule->pattern);
+                server_stop(server, EXIT_RESTART);
+            }
+            break;
+        case RULE_EVENT:
+            printf("[%s] Event %s\n", server->id, rule->arg);
+            events_post(server->id, "rule", "%s", rule->arg);
+            break;
+        case RULE_COUNT:
+            break;
+        case RULE_SAMPLE:
+            telemetry_sample(server, rule->arg, line);
+            break;
+    }
+}
+
+void rules_match(struct rules_t *rules, struct server_t *server, const char *line)
+{
+    const unsigned char *p;
+    int s, t, r, n;
+
+    n = rules->nclasses;
+    rules->lineno++;
+    s = 0;
+    for (p = (const unsigned char *) line; *p; ++p) {
+        s = rules->delta[s * n + rules->classes[*p]];
+        for (t = rules->out[s] >= 0 ? s : rules->dict[s]; t; t = rules->dict[t]) {
+            for (r = rules->out[t]; r >= 0; r = rules->rules[r].next) {
+                if (rules->rules[r].seen == rules->lineno)
+                    continue;
+                rules->rules[r].seen = rules->lineno;
+                rules_fire(&rules->rules[r], server, line);
+            }
+        }
+    }
+}
+
+void rules_free(struct rules_t *rules)
+{
+    int i;
+
+    if (!rules)
+        return;
+    for (i = 0; i < rules->len; ++i) {
+        free(rules->rules[i].pattern);
+        free(rules->rules[i].arg);
+    }
+    free(rules->rules);
+    free(rules->delta);
+    free(rules->out);
+    free(rules->dict);
+    free(rules);
+}
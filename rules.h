@@ -0,0 +1,60 @@
+//
+//  rules.h
+//  mcmdd
+//
+//  Configurable reactions to console output.
+//
+
+#ifndef mcmdd_rules_h
+#define mcmdd_rules_h
+
+#include "server.h"
+
+enum rule_action_t {
+    // mark a starting server as running
+    RULE_STATUS = 0,
+    // send a console command
+    RULE_EXEC,
+    // restart the server
+    RULE_RESTART,
+    // log an event and post it to WATCH subscribers
+    RULE_EVENT,
+    // only count matches
+    RULE_COUNT,
+    // parse a telemetry sample out of the line
+    RULE_SAMPLE
+};
+
+struct rule_t {
+    char *pattern;
+    enum rule_action_t action;
+    char *arg;
+    volatile long hits;
+    // next rule with the same pattern
+    int next;
+    // last line this rule fired on, so it fires once per line
+    unsigned long seen;
+};
+
+struct rules_t {
+    struct rule_t *rules;
+    int len, max;
+    // Aho-Corasick automaton over an alphabet reduced to the bytes used
+    // in patterns, so the transition table stays small
+    unsigned char classes[256];
+    int nclasses;
+    int *delta;
+    // first rule ending at a state, and the nearest suffix state with output
+    int *out, *dict;
+    int nstates;
+    unsigned long lineno;
+};
+
+struct rules_t *rules_new(void);
+int rules_add(struct rules_t *rules, const char *spec);
+void rules_compile(struct rules_t *rules);
+void rules_match(struct rules_t *rules, struct server_t *server, const char *line);
+const char *rules_action_name(enum rule_action_t action);
+void rules_free(struct rules_t *rules);
+
+#endif
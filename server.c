@@ -8,21 +8,31 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <err.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <assert.h>
+#include <fcntl.h>
 
 #include "server.h"
+#include "rules.h"
+#include "telemetry.h"
+#include "placement.h"
+#include "input.h"
+#include "flood.h"
+#include "cds.h"
+#include "history.h"
+#include "trace.h"
+#include "statpage.h"
+#include "events.h"
+#include "reader.h"
 
-struct server_t *server_new(const char *path, const char *command, const char *id)
+char *const *server_parse_command(const char *command)
 {
-    struct server_t *server = malloc(sizeof(struct server_t));
-    server->id = strdup(id);
-    server->path = strdup(path);
-    char **argv = malloc(sizeof(char *) * strlen(command));
+    char **argv = malloc(sizeof(char *) * (strlen(command) + 1));
 
 	size_t len = 0;
 	char *str_ = malloc(strlen(command) + 1);
@@ -47,99 +57,207 @@ struct server_t *server_new(const char *path, const char *command, const char *i
         argv[len++] = strdup(str_);
     }
     argv[len] = NULL; // must be null terminated for execv
-    server->argv = argv;
-    server->linsp = 0;
-    bzero(server->lines, SERVER_MAXLINES);
 	free(str_);
-    return server;
+    return argv;
 }
 
-static inline void server_cleanup(struct server_t *server)
+void server_free_argv(char *const *argv)
 {
     size_t i;
     char *str;
-    
     i = 0;
-    str = server->lines[i++];
+    str = argv[i++];
     while (str) {
         free(str);
-        str = server->lines[i++];
+        str = argv[i++];
     }
+    free((void *) argv);
+}
+
+struct server_t *server_new(const char *path, const char *command, const char *id)
+{
+    struct server_t *server = malloc(sizeof(struct server_t));
+    server->id = strdup(id);
+    server->path = strdup(path);
+    server->argv = server_parse_command(command);
+    server->status = STATUS_STOPPED;
+    server->ctrl = CTRL_CLEAN;
+    server->history = history_new(DEFAULT_HISTORY_MEMORY);
+    server->start_begin = server->stop_begin = 0;
+    server->failures = 0;
+    server->next_attempt = 0;
+    server->adopted = 0;
+    server->spare = NULL;
+    server->hibernate = NULL;
+    server->rules = rules_new();
+    rules_add(server->rules, "Done => status running");
+    rules_add(server->rules, "Can't keep up! => sample lag");
+    rules_add(server->rules, "TPS from last => sample tps");
+    rules_add(server->rules, "GC( => sample gc");
+    rules_add(server->rules, "[GC  => sample gc");
+    rules_add(server->rules, "[Full GC => sample gc");
+    rules_add(server->rules, "There are  => sample players");
+    rules_compile(server->rules);
+    server->telemetry = telemetry_new();
+    server->watchdog = NULL;
+    server->placement = NULL;
+    server->memory = NULL;
+    server->pipein = -1;
+    server->input = input_new(DEFAULT_INPUT_QUEUE);
+    server->flood = NULL;
+    server->page = NULL;
+    server->cds = NULL;
+    return server;
 }
 
 void server_free(struct server_t *server)
 {
-    size_t i;
-    char *str;
     free(server->id);
     free(server->path);
-    i = 0;
-    str = server->argv[i++];
-    while (str) {
-        free(str);
-        str = server->argv[i++];
-    }
-    server_cleanup(server);
+    server_free_argv(server->argv);
+    history_free(server->history);
+    rules_free(server->rules);
+    telemetry_free(server->telemetry);
+    input_free(server->input);
     free(server);
 }
 
-static void add_line(struct server_t *server, const char *line)
+void server_note(struct server_t *server, const char *message)
+{
+    history_add(server->history, message);
+}
+
+struct dump_t {
+    FILE *file;
+    int count;
+};
+
+static int dump_line(void *ctx, const struct history_line_t *line)
+{
+    struct dump_t *dump = ctx;
+    fprintf(dump->file, "%s\n", line->text);
+    dump->count++;
+    return 0;
+}
+
+/*!
+ * @return number of lines written
+ */
+int server_dump_log(struct server_t *server, FILE *file)
 {
-    if (server->linsp >= SERVER_MAXLINES)
-        server->linsp = 0;
-    if (server->lines[server->linsp])
-        free(server->lines[server->linsp]);
-    server->lines[server->linsp++] = strdup(line);
+    struct dump_t dump = { file, 0 };
+    history_each(server->history, 0, dump_line, &dump);
+    return dump.count;
 }
 
 static inline void process_line(struct server_t *server, const char *line)
 {
-    add_line(server, line);
-    printf("[%s] #%2d: %s\n", server->id, server->linsp, line);
-    if (server->status == STATUS_STARTING && strstr(line, "Done"))
-        server->status = STATUS_RUNNING;
+    unsigned long seq;
+    // flooded lines stay out of history and log, but rules still see them
+    seq = 0;
+    if (flood_admit(server, line)) {
+        seq = history_add(server->history, line);
+        printf("[%s] #%2lu: %s\n", server->id, seq, line);
+    }
+    if (server->cds)
+        cds_line(server, line);
+    rules_match(server->rules, server, line);
     time(&server->last_read);
+    server->lines++;
+    statpage_line(server, seq);
+}
+
+/*!
+ * Splits console output into lines for process_line().
+ * @param buf holds the line that is not complete yet, *sp its length
+ */
+void server_read(struct server_t *server, const char *chunk, size_t n, char *buf, int *sp)
+{
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        // lines longer than max are cycled around
+        if (chunk[i] == '\n' || *sp >= SERVER_LINEMAX - 1) {
+            buf[*sp] = '\0';
+            process_line(server, buf);
+            *sp = 0;
+            if (chunk[i] == '\n')
+                continue;
+        }
+        buf[(*sp)++] = chunk[i];
+    }
 }
 
 static void read_line(int fd, struct server_t *server)
 {
-    char ch, buf[SERVER_LINEMAX];
+    char chunk[4096], buf[SERVER_LINEMAX];
+    ssize_t n;
     int sp;
     
     sp = 0;
-    while (read(fd, &ch, 1) != 0) {
-        // lines longer than max are cycled around
-        if (ch == '\n' || sp >= SERVER_LINEMAX) {
-            // null-terminate
-            buf[sp++] = '\0';
-            process_line(server, buf);
-            sp = 0;
-        } else {
-            buf[sp++] = ch;
+    while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
         }
+        server_read(server, chunk, n, buf, &sp);
     }
 }
 
-int server_send(struct server_t *server, const char *message)
+static int send_input(struct server_t *server, const char *message, int urgent)
 {
+    int rc;
+    long long begin;
     if (server->status == STATUS_STOPPED)
         return -1;
-    add_line(server, message);
+    begin = trace_now();
+    rc = urgent ? input_push_urgent(server, message, strlen(message))
+                : input_push(server, message, strlen(message));
+    if (rc < 0)
+        return rc;
+    history_add(server->history, message);
     printf("[%s] < %s", server->id, message);
-    write(server->pipein, message, strlen(message));
+    trace_record("send", server->id, begin);
     return 0;
 }
 
+/*!
+ * @return 0 when queued, -1 if the server is off, -2 if its input queue is full
+ */
+int server_send(struct server_t *server, const char *message)
+{
+    return send_input(server, message, 0);
+}
+
+// a restart only applies to a server that is up; a stopped, paused or
+// hibernating one stays down, and one in a backup waits for it to finish
+static inline int restartable(struct server_t *server)
+{
+    return server->status == STATUS_STARTING || server->status == STATUS_RUNNING
+        || server->status == STATUS_STOPPING;
+}
+
 void server_stop(struct server_t *server, int exit)
 {
+    if (exit == EXIT_RESTART && !restartable(server))
+        return;
     if (exit == EXIT_FULL)
         server->ctrl = CTRL_EXIT;
     else if (exit == EXIT_PAUSE)
         server->ctrl = CTRL_PAUSE;
+    else if (exit == EXIT_RESTART)
+        // a requested restart is not a crash, start again right away
+        server->ctrl = CTRL_LAUNCH;
     if (server->status == STATUS_STOPPED)
         return;
+    if (!server->stop_begin)
+        server->stop_begin = trace_now();
     server->status = STATUS_STOPPING;
-    server_send(server, SHUTDOWN_COMMAND);
+    statpage_update(server);
+    events_post(server->id, "stopping", NULL);
+    // goes in the queue's reserve if it is full, a STOP must not be lost
+    send_input(server, SHUTDOWN_COMMAND, 1);
 }
 
 void server_stop_kill(struct server_t *server, int exit, int wait)
@@ -158,15 +276,24 @@ void server_stop_kill(struct server_t *server, int exit, int wait)
 
 int server_kill(struct server_t *server, int exit)
 {
+    if (exit == EXIT_RESTART && !restartable(server))
+        return -1;
     if (exit == EXIT_FULL)
         server->ctrl = CTRL_EXIT;
     else if (exit == EXIT_PAUSE)
         server->ctrl = CTRL_PAUSE;
+    else if (exit == EXIT_RESTART)
+        // a requested restart is not a crash, start again right away
+        server->ctrl = CTRL_LAUNCH;
     if (server->status == STATUS_STOPPED)
         return -1;
+    if (!server->stop_begin)
+        server->stop_begin = trace_now();
     server->status = STATUS_STOPPED;
+    statpage_update(server);
+    events_post(server->id, "kill", "%d", server->pid);
     printf("[%s] Killing server process %d\n", server->id, server->pid);
-    add_line(server, "Server process killed");
+    history_add(server->history, "Server process killed");
     return kill(server->pid, SIGKILL);
 }
 
@@ -177,6 +304,7 @@ void server_resume(struct server_t *server)
         return;
     }
     server->ctrl = CTRL_LAUNCH;
+    statpage_update(server);
 }
 
 void server_set_backup(struct server_t *server, int flag)
@@ -186,57 +314,106 @@ void server_set_backup(struct server_t *server, int flag)
     } else {
         server->status = STATUS_STOPPED;
     }
+    statpage_update(server);
 }
 
-int server_start(struct server_t *server)
+long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+pid_t server_spawn(const char *id, const char *path, char *const *argv,
+                   const struct placement_t *placement, int *pipein, int *pipeout)
 {
-    pid_t cpid, pid;
-    int pipeout[2], pipein[2];
+    pid_t cpid;
+    int outp[2], inp[2];
     // pipe for reading from the server console
-    pipe(pipeout);
+    pipe(outp);
     // pipe for sending commands and messages to the server
-    pipe(pipein);
-    // status field is to allow other threads to check how the server is doing
-    server->status = STATUS_STARTING;
-    server->pipein = pipein[1];
-    time(&server->start);
+    pipe(inp);
+    // keep other servers (and hot spares) from inheriting these pipes, a
+    // stray write end in another child would hold off our end of file
+    fcntl(outp[0], F_SETFD, FD_CLOEXEC);
+    fcntl(outp[1], F_SETFD, FD_CLOEXEC);
+    fcntl(inp[0], F_SETFD, FD_CLOEXEC);
+    fcntl(inp[1], F_SETFD, FD_CLOEXEC);
     cpid = fork(); // program execution flow 'forks' here
     if (cpid == 0) {
         // child process started for server
         // assign the standard in, out, and error so the server can be monitored
-        dup2(pipein[0], 0);
-        dup2(pipeout[1], 1);
-        dup2(pipeout[1], 2);
+        dup2(inp[0], 0);
+        dup2(outp[1], 1);
+        dup2(outp[1], 2);
         // close the original pipes (the functions above created clones)
-        close(pipeout[0]);
-        close(pipeout[1]);
-        close(pipein[1]);
-        close(pipeout[1]);
+        close(outp[0]);
+        close(outp[1]);
+        close(inp[0]);
+        close(inp[1]);
         // go to the server's data directory
-        chdir(server->path);
+        chdir(path);
+        // pin to cores, memory nodes and priorities before the JVM starts
+        placement_apply(placement);
         // launch it, calling java (or whatever) from the server's PATH
-        execvp(server->argv[0], server->argv);
-        err(1, "server exec failed for %s", server->id);
-    } else if (cpid > 0) {
-        // parent process to monitor server
-        int status;
-        // close the ends of the pipe that we shouldn't be using
-        // e.g. writing to the pipe that returns the child's output
-        close(pipeout[1]);
-        close(pipein[0]);
-        server->pid = cpid;
-        printf("[%s] Starting on PID %d.\n", server->id, cpid);
-        // read until the server stops
-        read_line(pipeout[0], server);
-        // close the pipes as we are all done
-        close(pipeout[0]);
-        close(pipein[1]);
-        // get the status and prevent creating zombies
-        pid = wait(&status);
-        server->status = STATUS_STOPPED;
-        printf("[%s] PID %d exists with %d.\n", server->id, pid, status);
-        return status;
-    } else {
-        err(1, "server fork failed for %s", server->id);
+        execvp(argv[0], argv);
+        err(1, "server exec failed for %s", id);
+    } else if (cpid < 0) {
+        err(1, "server fork failed for %s", id);
     }
-}
\ No newline at end of file
+    // parent process to monitor server
+    // close the ends of the pipe that we shouldn't be using
+    // e.g. writing to the pipe that returns the child's output
+    close(outp[1]);
+    close(inp[0]);
+    *pipein = inp[1];
+    *pipeout = outp[0];
+    return cpid;
+}
+
+int server_monitor(struct server_t *server)
+{
+    int status;
+    pid_t pid;
+    // read until the server stops, on the reader thread if there is one
+    if (reader_wait(server, server->pipeout) < 0)
+        read_line(server->pipeout, server);
+    // close the pipes as we are all done
+    close(server->pipeout);
+    input_detach(server);
+    // get the status and prevent creating zombies. only our own child, as
+    // other servers and hot spares are reaped by their own threads
+    pid = waitpid(server->pid, &status, 0);
+    if (server->cds)
+        cds_exited(server);
+    server->status = STATUS_STOPPED;
+    // from the stop request until the process is gone
+    if (server->stop_begin)
+        trace_record("stop", server->id, server->stop_begin);
+    server->start_begin = server->stop_begin = 0;
+    statpage_update(server);
+    if (WIFSIGNALED(status))
+        events_post(server->id, "stopped", "signal %d", WTERMSIG(status));
+    else
+        events_post(server->id, "stopped", "exit %d", WEXITSTATUS(status));
+    printf("[%s] PID %d exists with %d.\n", server->id, pid, status);
+    return status;
+}
+
+int server_start(struct server_t *server)
+{
+    int pipein;
+    // status field is to allow other threads to check how the server is doing
+    server->status = STATUS_STARTING;
+    server->start_begin = trace_now();
+    time(&server->start);
+    placement_acquire(server);
+    server->pid = server_spawn(server->id, server->path,
+                               server->cds ? cds_argv(server) : server->argv,
+                               server->placement, &pipein, &server->pipeout);
+    input_attach(server, pipein);
+    statpage_update(server);
+    events_post(server->id, "starting", "%d", server->pid);
+    printf("[%s] Starting on PID %d.\n", server->id, server->pid);
+    return server_monitor(server);
+}
@@ -9,6 +9,7 @@
 #ifndef mcmdd_server_h
 #define mcmdd_server_h
 
+#include <stdio.h>
 #include <time.h>
 #include <sys/types.h>
 
@@ -42,10 +43,22 @@ enum exit {
     EXIT_RESTART
 };
 
-#define SERVER_MAXLINES 1024
 #define SERVER_LINEMAX 1024
 #define SHUTDOWN_COMMAND "stop\n"
 
+struct spare_t;
+struct hibernate_t;
+struct rules_t;
+struct telemetry_t;
+struct watchdog_t;
+struct placement_t;
+struct memory_t;
+struct input_t;
+struct flood_t;
+struct history_t;
+struct statpage_record_t;
+struct cds_t;
+
 struct server_t {
     pid_t pid;
     char *path;
@@ -53,15 +66,54 @@ struct server_t {
     char *id;
     enum server_status_t status;
     enum server_control_t ctrl;
-    int pipein, linsp;
-    char *lines[SERVER_MAXLINES];
+    int pipein, pipeout;
+    // console lines and commands sent, see history.h
+    struct history_t *history;
     time_t start, last_read;
+    // console lines read so far, to tell which came after a point
+    unsigned long lines;
+    // trace_now() when a start or stop began, 0 when none is under way
+    long long start_begin, stop_begin;
+    // crashes in a row without warming up, and when the next start is due
+    int failures;
+    time_t next_attempt;
+    // process carried over from before a handover, to monitor rather than start
+    int adopted;
+    // standby process for hot-spare mode, NULL when disabled
+    struct spare_t *spare;
+    // idle hibernation settings, NULL when disabled
+    struct hibernate_t *hibernate;
+    // console rules, always holding at least the "Done" rule
+    struct rules_t *rules;
+    struct telemetry_t *telemetry;
+    // liveness probing, NULL when disabled
+    struct watchdog_t *watchdog;
+    // cores, memory nodes and priorities, NULL to inherit ours
+    struct placement_t *placement;
+    // RSS tracking for leak restarts, NULL when disabled
+    struct memory_t *memory;
+    // commands waiting to be written to pipein
+    struct input_t *input;
+    struct flood_t *flood;
+    // this server's record in the status page, NULL when there is none
+    struct statpage_record_t *page;
+    // class data sharing archive, NULL when disabled
+    struct cds_t *cds;
 };
 
 struct server_t *server_new(const char *path, const char *command, const char *id);
 void server_free(struct server_t *server);
+char *const *server_parse_command(const char *command);
+void server_free_argv(char *const *argv);
+long long monotonic_ms(void);
+pid_t server_spawn(const char *id, const char *path, char *const *argv,
+                   const struct placement_t *placement, int *pipein, int *pipeout);
+int server_monitor(struct server_t *server);
 int server_start(struct server_t *server);
 int server_send(struct server_t *server, const char *message);
+void server_note(struct server_t *server, const char *message);
+int server_dump_log(struct server_t *server, FILE *file);
+void server_read(struct server_t *server, const char *chunk, size_t n, char *buf, int *sp);
 void server_stop(struct server_t *server, int exit);
 void server_stop_kill(struct server_t *server, int exit, int wait);
 int server_kill(struct server_t *server, int exit);
@@ -0,0 +1,220 @@
+//
+//  spare.c
+//  mcmdd
+//
+//  A hot spare is a second copy of a server that is launched in the
+//  background and left warmed up. When the live process exits, the spare
+//  takes over its identity and a new spare is started in the slot the old
+//  live process used, so players only wait for the promotion rather than
+//  a whole JVM boot and world load.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#include "spare.h"
+#include "input.h"
+#include "events.h"
+#include "placement.h"
+
+void spare_init(struct server_t *server, const char *path, const char *command)
+{
+    struct spare_t *spare = malloc(sizeof(struct spare_t));
+    if (!spare)
+        err(1, "Failed to allocate memory");
+    spare->path = strdup(path);
+    spare->argv = server_parse_command(command);
+    spare->running = 0;
+    spare->release = 0;
+    spare->pid = 0;
+    spare->ready = 0;
+    spare->promotions = 0;
+    spare->last_promotion_ms = -1;
+    if (pipe(spare->wake) < 0)
+        err(1, "pipe for hot spare of %s", server->id);
+    fcntl(spare->wake[0], F_SETFD, FD_CLOEXEC);
+    fcntl(spare->wake[1], F_SETFD, FD_CLOEXEC);
+    server->spare = spare;
+}
+
+/*!
+ * Drains the standby's console until it is handed over, so a chatty
+ * server can't fill the pipe and block while it waits.
+ * @return 0 when released, -1 if the standby exited on its own
+ */
+static int spare_drain(struct server_t *server, struct spare_t *spare)
+{
+    char chunk[512], line[SERVER_LINEMAX], ch;
+    struct pollfd pfd[2];
+    ssize_t r, i;
+    int sp;
+
+    pfd[0].fd = spare->pipeout;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = spare->wake[0];
+    pfd[1].events = POLLIN;
+    sp = 0;
+    while (!spare->release) {
+        if (poll(pfd, 2, -1) < 0)
+            continue; // interrupted sys call
+        if (pfd[1].revents) {
+            read(spare->wake[0], &ch, 1);
+            continue;
+        }
+        r = read(spare->pipeout, chunk, sizeof(chunk));
+        if (r <= 0)
+            return -1;
+        for (i = 0; i < r; ++i) {
+            if (chunk[i] == '\n' || sp >= SERVER_LINEMAX - 1) {
+                line[sp] = '\0';
+                if (!spare->ready && strstr(line, "Done")) {
+                    spare->ready = 1;
+                    printf("[%s] Hot spare PID %d is ready.\n", server->id, spare->pid);
+                }
+                sp = 0;
+            } else {
+                line[sp++] = chunk[i];
+            }
+        }
+    }
+    return 0;
+}
+
+static void *spare_thread(void *ptr)
+{
+    struct server_t *server = ptr;
+    struct spare_t *spare = server->spare;
+    int status;
+
+    // wait for the live server so two JVMs aren't booting at the same time
+    while (server->status != STATUS_RUNNING && !spare->release)
+        usleep(100000);
+    if (spare->release)
+        return NULL;
+    time(&spare->start);
+    spare->pid = server_spawn(server->id, spare->path, spare->argv, server->placement,
+                              &spare->pipein, &spare->pipeout);
+    printf("[%s] Warming hot spare on PID %d.\n", server->id, spare->pid);
+    if (spare_drain(server, spare) < 0) {
+        close(spare->pipein);
+        close(spare->pipeout);
+        waitpid(spare->pid, &status, 0);
+        printf("[%s] Hot spare PID %d exited with %d.\n", server->id, spare->pid, status);
+        spare->pid = 0;
+        spare->ready = 0;
+    }
+    return NULL;
+}
+
+void spare_launch(struct server_t *server)
+{
+    struct spare_t *spare = server->spare;
+    int rc;
+
+    if (!spare || spare->running)
+        return;
+    spare->release = 0;
+    spare->ready = 0;
+    spare->pid = 0;
+    rc = pthread_create(&spare->thread, NULL, spare_thread, server);
+    if (rc)
+        err(1, "pthread_create for hot spare of %s", server->id);
+    spare->running = 1;
+}
+
+static void spare_join(struct spare_t *spare)
+{
+    if (!spare->running)
+        return;
+    spare->release = 1;
+    write(spare->wake[1], "", 1);
+    pthread_join(spare->thread, NULL);
+    spare->running = 0;
+}
+
+int spare_promote(struct server_t *server)
+{
+    struct spare_t *spare = server->spare;
+    long long begin;
+    char *path;
+    char *const *argv;
+    char msg[64];
+
+    if (!spare || !spare->running)
+        return -1;
+    begin = monotonic_ms();
+    spare_join(spare);
+    if (!spare->pid)
+        return -1;
+    // the spare takes over the live identity
+    server->pid = spare->pid;
+    input_attach(server, spare->pipein);
+    server->pipeout = spare->pipeout;
+    server->start = spare->start;
+    server->status = spare->ready ? STATUS_RUNNING : STATUS_STARTING;
+    // the cores it was started on may have gone back to the pool with a STOP
+    placement_acquire(server);
+    placement_pin(server->placement, server->pid);
+    // swap slots, so the next spare launches where the old process ran
+    path = server->path;
+    server->path = spare->path;
+    spare->path = path;
+    argv = server->argv;
+    server->argv = spare->argv;
+    spare->argv = argv;
+    spare->pid = 0;
+    spare->promotions++;
+    spare->last_promotion_ms = monotonic_ms() - begin;
+    printf("[%s] Promoted %s hot spare PID %d in %lld ms.\n", server->id,
+           spare->ready ? "warm" : "cold", server->pid, spare->last_promotion_ms);
+    events_post(server->id, "promoted", "%d", server->pid);
+    snprintf(msg, sizeof(msg), "Promoted hot spare in %lld ms", spare->last_promotion_ms);
+    server_note(server, msg);
+    return 0;
+}
+
+void spare_stop(struct server_t *server, int wait)
+{
+    struct spare_t *spare = server->spare;
+    int status, waited_ms;
+
+    if (!spare)
+        return;
+    spare_join(spare);
+    if (!spare->pid)
+        return;
+    printf("[%s] Stopping hot spare PID %d.\n", server->id, spare->pid);
+    write(spare->pipein, SHUTDOWN_COMMAND, strlen(SHUTDOWN_COMMAND));
+    for (waited_ms = 0; waitpid(spare->pid, &status, WNOHANG) == 0; waited_ms += 100) {
+        if (waited_ms >= wait * 1000) {
+            kill(spare->pid, SIGKILL);
+            waitpid(spare->pid, &status, 0);
+            break;
+        }
+        usleep(100000);
+    }
+    close(spare->pipein);
+    close(spare->pipeout);
+    spare->pid = 0;
+}
+
+void spare_free(struct server_t *server)
+{
+    struct spare_t *spare = server->spare;
+
+    if (!spare)
+        return;
+    free(spare->path);
+    server_free_argv(spare->argv);
+    close(spare->wake[0]);
+    close(spare->wake[1]);
+    free(spare);
+    server->spare = NULL;
+}
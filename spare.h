@@ -0,0 +1,39 @@
+//
+//  spare.h
+//  mcmdd
+//
+//  Hot-spare standby processes for stateless servers (lobbies, minigames).
+//
+
+#ifndef mcmdd_spare_h
+#define mcmdd_spare_h
+
+#include <pthread.h>
+
+#include "server.h"
+
+struct spare_t {
+    // the standby alternates with the live server between these two slots
+    char *path;
+    char *const *argv;
+    pthread_t thread;
+    int running;
+    // set to hand the standby over, wake is used to interrupt its reader
+    volatile int release;
+    int wake[2];
+    pid_t pid;
+    int pipein, pipeout;
+    // standby has printed "Done" and is ready to take players
+    volatile int ready;
+    time_t start;
+    int promotions;
+    long long last_promotion_ms;
+};
+
+void spare_init(struct server_t *server, const char *path, const char *command);
+void spare_launch(struct server_t *server);
+int spare_promote(struct server_t *server);
+void spare_stop(struct server_t *server, int wait);
+void spare_free(struct server_t *server);
+
+#endif
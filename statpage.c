@@ -0,0 +1,266 @@
+//
+//  statpage.c
+//  mcmdd
+//
+//  The daemon writes the status page to a temporary file and renames it
+//  into place once every record is filled in, so a reader never maps a
+//  half-made one. Every state change and every console line then goes
+//  through statpage_update() or statpage_line(), which take a record's
+//  sequence lock by compare-and-swap, since the server's own thread, the
+//  control threads and the monitors all change servers. Readers only need
+//  the file and this file's reader half.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "statpage.h"
+
+struct statpage_t {
+    void *map;
+    size_t size;
+    const struct statpage_header_t *header;
+};
+
+static struct statpage_header_t *page;
+
+static inline size_t page_size(int count)
+{
+    return sizeof(struct statpage_header_t) + count * sizeof(struct statpage_record_t);
+}
+
+static inline uint32_t write_begin(struct statpage_record_t *record)
+{
+    uint32_t seq = __atomic_load_n(&record->seq, __ATOMIC_RELAXED);
+    for (;;) {
+        if (seq & 1)
+            seq = __atomic_load_n(&record->seq, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&record->seq, &seq, seq + 1, 1,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    // the odd count must be seen before any of the fields change
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return seq;
+}
+
+static inline void write_end(struct statpage_record_t *record, uint32_t seq)
+{
+    __atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// everything but the counters the record keeps itself
+static void fill(struct statpage_record_t *record, const struct server_t *server)
+{
+    if (server->pid != record->pid && server->pid > 0)
+        record->starts++;
+    if (record->backup && server->status != STATUS_BACKUP)
+        record->last_backup = time(NULL);
+    record->status = server->status;
+    record->ctrl = server->ctrl;
+    record->pid = server->pid;
+    record->failures = server->failures;
+    record->backup = server->status == STATUS_BACKUP;
+    record->start = server->start;
+    record->last_read = server->last_read;
+    record->next_attempt = server->next_attempt;
+}
+
+/*!
+ * Creates the page at path and points each server at its record.
+ * @return 0, or -1 if the file could not be made
+ */
+int statpage_create(const char *path, struct server_t **servers, int count)
+{
+    char tmp[4096];
+    size_t size;
+    void *map;
+    int fd, i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    size = page_size(count);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        warn("Failed to create status page %s", tmp);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        warn("Failed to map status page %s", tmp);
+        unlink(tmp);
+        return -1;
+    }
+    page = map;
+    page->magic = STATPAGE_MAGIC;
+    page->version = STATPAGE_VERSION;
+    page->count = count;
+    page->record_size = sizeof(struct statpage_record_t);
+    page->daemon_pid = getpid();
+    for (i = 0; i < count; ++i) {
+        struct statpage_record_t *record = (struct statpage_record_t *) (page + 1) + i;
+        strncpy(record->id, servers[i]->id, STATPAGE_IDMAX - 1);
+        fill(record, servers[i]);
+        // a server adopted in a handover was not started by us
+        record->starts = 0;
+        servers[i]->page = record;
+    }
+    if (rename(tmp, path) < 0) {
+        warn("Failed to move status page to %s", path);
+        for (i = 0; i < count; ++i)
+            servers[i]->page = NULL;
+        munmap(map, size);
+        unlink(tmp);
+        page = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*!
+ * Publishes the server's status, control state, pid and restart fields.
+ */
+void statpage_update(struct server_t *server)
+{
+    struct statpage_record_t *record = server->page;
+    uint32_t seq;
+
+    if (!record)
+        return;
+    seq = write_begin(record);
+    fill(record, server);
+    write_end(record, seq);
+}
+
+/*!
+ * Counts a console line.
+ * @param seq its history sequence number, 0 if it was not kept
+ */
+void statpage_line(struct server_t *server, unsigned long seq)
+{
+    struct statpage_record_t *record = server->page;
+    uint32_t lock;
+
+    if (!record)
+        return;
+    lock = write_begin(record);
+    record->lines++;
+    if (seq)
+        record->last_seq = seq;
+    record->last_read = server->last_read;
+    write_end(record, lock);
+}
+
+void statpage_set_closed(int closed)
+{
+    if (page)
+        __atomic_store_n(&page->closed, closed, __ATOMIC_RELEASE);
+}
+
+/*!
+ * Maps a status page for reading.
+ * @return NULL if it can't be opened or is not a status page
+ */
+struct statpage_t *statpage_open(const char *path)
+{
+    struct statpage_t *reader;
+    const struct statpage_header_t *header;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct statpage_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    header = map;
+    // records may grow at the end in later versions, so a bigger record_size is fine
+    if (header->magic != STATPAGE_MAGIC || header->version != STATPAGE_VERSION
+        || header->record_size < sizeof(struct statpage_record_t)
+        || sizeof(*header) + (size_t) header->count * header->record_size > st.st_size) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    reader = malloc(sizeof(struct statpage_t));
+    if (!reader)
+        err(1, "Failed to allocate memory");
+    reader->map = map;
+    reader->size = st.st_size;
+    reader->header = header;
+    return reader;
+}
+
+int statpage_count(const struct statpage_t *reader)
+{
+    return reader->header->count;
+}
+
+int statpage_closed(const struct statpage_t *reader)
+{
+    return __atomic_load_n(&reader->header->closed, __ATOMIC_ACQUIRE);
+}
+
+int statpage_daemon_pid(const struct statpage_t *reader)
+{
+    return reader->header->daemon_pid;
+}
+
+/*!
+ * Copies out a consistent snapshot of a record, without a system call.
+ * @return 0, or -1 if there is no such record
+ */
+int statpage_read(const struct statpage_t *reader, int index, struct statpage_record_t *out)
+{
+    const struct statpage_record_t *record;
+    uint32_t before, after;
+
+    if (index < 0 || index >= reader->header->count)
+        return -1;
+    record = (const void *) ((const char *) (reader->header + 1) + index * reader->header->record_size);
+    do {
+        before = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, record, sizeof(*out));
+        // the copy must be done before the count is looked at again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&record->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+    out->id[STATPAGE_IDMAX - 1] = '\0';
+    return 0;
+}
+
+/*!
+ * @return the index of the server's record, or -1
+ */
+int statpage_find(const struct statpage_t *reader, const char *id)
+{
+    struct statpage_record_t record;
+    int i;
+
+    for (i = 0; statpage_read(reader, i, &record) == 0; ++i)
+        if (strcmp(record.id, id) == 0)
+            return i;
+    return -1;
+}
+
+void statpage_close(struct statpage_t *reader)
+{
+    munmap(reader->map, reader->size);
+    free(reader);
+}
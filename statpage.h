@@ -0,0 +1,67 @@
+//
+//  statpage.h
+//  mcmdd
+//
+//  A file with one fixed-layout record per server that mcmdd keeps up to
+//  date in place, for monitoring tools to mmap and read without a
+//  connection. Each record is guarded by a sequence lock: the count is
+//  odd while a write is under way, so a reader copies the record and
+//  tries again if the count was odd or changed in the meantime.
+//
+
+#ifndef mcmdd_statpage_h
+#define mcmdd_statpage_h
+
+#include <stdint.h>
+
+#define STATPAGE_MAGIC 0x7367706dU
+#define STATPAGE_VERSION 1
+#define STATPAGE_IDMAX 64
+
+struct statpage_header_t {
+    uint32_t magic, version;
+    // records that follow, and the size of each
+    uint32_t count, record_size;
+    int32_t daemon_pid;
+    // set when the daemon exits or hands over, reopen the file then
+    uint32_t closed;
+};
+
+struct statpage_record_t {
+    uint32_t seq;
+    char id[STATPAGE_IDMAX];
+    // enum server_status_t and enum server_control_t
+    int32_t status, ctrl;
+    int32_t pid;
+    // crashes in a row without warming up
+    int32_t failures;
+    // starts, including takeovers by a hot spare
+    uint32_t starts;
+    // 1 while a backup runs
+    uint32_t backup;
+    // unix times, 0 for never
+    int64_t start, last_read, next_attempt, last_backup;
+    // console lines read by this daemon, and the history sequence number
+    // of the last one kept (flooded lines are not)
+    uint64_t lines, last_seq;
+};
+
+struct server_t;
+struct statpage_t;
+
+// daemon side
+int statpage_create(const char *path, struct server_t **servers, int count);
+void statpage_update(struct server_t *server);
+void statpage_line(struct server_t *server, unsigned long seq);
+void statpage_set_closed(int closed);
+
+// reader side
+struct statpage_t *statpage_open(const char *path);
+int statpage_count(const struct statpage_t *page);
+int statpage_closed(const struct statpage_t *page);
+int statpage_daemon_pid(const struct statpage_t *page);
+int statpage_read(const struct statpage_t *page, int index, struct statpage_record_t *out);
+int statpage_find(const struct statpage_t *page, const char *id);
+void statpage_close(struct statpage_t *page);
+
+#endif
@@ -0,0 +1,210 @@
+//
+//  telemetry.c
+//  mcmdd
+//
+//  Tick lag warnings, TPS reports and GC pauses are picked out of the
+//  console by "sample" rules and kept in a ring per metric, which PERF
+//  summarizes as percentiles. Replies to "list" keep the player count.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <err.h>
+
+#include "config.h"
+#include "telemetry.h"
+#include "flood.h"
+
+extern struct config_t *config;
+extern struct server_t **servers;
+extern int servers_sp;
+
+static const char *metric_names[] = {
+    "lag_ms", "lag_ticks", "tps", "gc_pause_ms"
+};
+
+struct telemetry_t *telemetry_new(void)
+{
+    struct telemetry_t *telemetry = calloc(1, sizeof(struct telemetry_t));
+    if (!telemetry)
+        err(1, "Failed to allocate memory");
+    pthread_mutex_init(&telemetry->lock, NULL);
+    telemetry->players = -1;
+    return telemetry;
+}
+
+void telemetry_free(struct telemetry_t *telemetry)
+{
+    pthread_mutex_destroy(&telemetry->lock);
+    free(telemetry);
+}
+
+static void record(struct telemetry_t *telemetry, enum metric_t metric, double value)
+{
+    struct series_t *series = &telemetry->series[metric];
+
+    pthread_mutex_lock(&telemetry->lock);
+    series->values[series->sp] = value;
+    time(&series->times[series->sp]);
+    series->sp = (series->sp + 1) % TELEMETRY_SAMPLES;
+    if (series->len < TELEMETRY_SAMPLES)
+        series->len++;
+    pthread_mutex_unlock(&telemetry->lock);
+}
+
+/*!
+ * Finds the number right before suffix, e.g. "3.456" in "... 3.456ms".
+ * @return 0 on success
+ */
+static int number_before(const char *line, const char *suffix, double *value)
+{
+    const char *end, *p, *found;
+
+    found = NULL;
+    for (p = strstr(line, suffix); p; p = strstr(p + 1, suffix))
+        found = p;
+    if (!found || found == line)
+        return -1;
+    end = found;
+    for (p = end; p > line && (isdigit((unsigned char) p[-1]) || p[-1] == '.'); --p)
+        ;
+    if (p == end)
+        return -1;
+    *value = strtod(p, NULL);
+    return 0;
+}
+
+void telemetry_sample(struct server_t *server, const char *metric, const char *line)
+{
+    const char *p;
+    double ms, ticks, value;
+    int players;
+
+    if (strcmp(metric, "lag") == 0) {
+        // Can't keep up! Is the server overloaded? Running 2345ms or 46 ticks behind
+        p = strstr(line, "Running ");
+        if (!p || sscanf(p, "Running %lfms or %lf ticks", &ms, &ticks) != 2)
+            return;
+        record(server->telemetry, METRIC_LAG_MS, ms);
+        record(server->telemetry, METRIC_LAG_TICKS, ticks);
+    } else if (strcmp(metric, "tps") == 0) {
+        // TPS from last 1m, 5m, 15m: 19.98, 20.0, 20.0 (possibly with colors)
+        p = strstr(line, "TPS from last");
+        if (!p || !(p = strchr(p, ':')))
+            return;
+        while (*p && !isdigit((unsigned char) *p)) {
+            // skip color codes such as "\u00a7a", the code may be a digit
+            if (p[0] == '\xc2' && p[1] == '\xa7' && p[2])
+                p += 3;
+            else
+                p++;
+        }
+        if (!*p)
+            return;
+        record(server->telemetry, METRIC_TPS, strtod(p, NULL));
+    } else if (strcmp(metric, "players") == 0) {
+        // answer to "list", e.g. "There are 0 of a max of 20 players online"
+        // or "There are 0/20 players online"
+        p = strstr(line, "There are ");
+        if (!p || sscanf(p, "There are %d", &players) != 1)
+            return;
+        server->telemetry->players = players;
+        time(&server->telemetry->players_at);
+        if (players > 0)
+            time(&server->telemetry->last_players);
+    } else if (strcmp(metric, "gc") == 0) {
+        // unified logging ends in "12.345ms", older logs in ", 0.0123 secs]"
+        if (strstr(line, "GC(") && !strstr(line, "Pause"))
+            return;
+        if (number_before(line, "ms", &value) == 0)
+            record(server->telemetry, METRIC_GC_MS, value);
+        else if (number_before(line, " secs]", &value) == 0)
+            record(server->telemetry, METRIC_GC_MS, value * 1000);
+    }
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int len, double p)
+{
+    // nearest rank
+    int i = (int) ceil(p * len) - 1;
+    return sorted[i < 0 ? 0 : i];
+}
+
+void telemetry_report(struct server_t *server, int fd)
+{
+    struct telemetry_t *telemetry = server->telemetry;
+    double sorted[TELEMETRY_SAMPLES];
+    char msg[256];
+    time_t now;
+    int i, m, len, lag_minute;
+
+    time(&now);
+    for (m = 0; m < METRIC_COUNT; ++m) {
+        struct series_t *series = &telemetry->series[m];
+        pthread_mutex_lock(&telemetry->lock);
+        len = series->len;
+        memcpy(sorted, series->values, sizeof(double) * len);
+        lag_minute = 0;
+        if (m == METRIC_LAG_MS)
+            for (i = 0; i < len; ++i)
+                if (difftime(now, series->times[i]) < 60)
+                    lag_minute++;
+        pthread_mutex_unlock(&telemetry->lock);
+        if (len == 0) {
+            snprintf(msg, sizeof(msg), "%s 0\n", metric_names[m]);
+        } else {
+            qsort(sorted, len, sizeof(double), compare_double);
+            // samples, p50, p90, p99, max
+            snprintf(msg, sizeof(msg), "%s %d %.2f %.2f %.2f %.2f\n", metric_names[m], len,
+                     percentile(sorted, len, 0.5), percentile(sorted, len, 0.9),
+                     percentile(sorted, len, 0.99), sorted[len - 1]);
+        }
+        write(fd, msg, strlen(msg));
+        if (m == METRIC_LAG_MS) {
+            snprintf(msg, sizeof(msg), "lag_per_minute %d\n", lag_minute);
+            write(fd, msg, strlen(msg));
+        }
+    }
+    snprintf(msg, sizeof(msg), "players %d\n", telemetry->players);
+    write(fd, msg, strlen(msg));
+}
+
+void *telemetry_monitor(void *ptr)
+{
+    size_t i;
+    const char *command;
+    char msg[256];
+    int interval;
+    time_t now, *last;
+
+    last = calloc(servers_sp, sizeof(time_t));
+    if (!last)
+        err(1, "Failed to allocate memory");
+    while (1) {
+        sleep(1);
+        time(&now);
+        for (i = 0; i < servers_sp; ++i) {
+            struct server_t *server = servers[i];
+            flood_tick(server);
+            interval = 0;
+            sscanf(config_get(config, server->id, "tps_interval", "0"), "%d", &interval);
+            if (interval <= 0 || server->status != STATUS_RUNNING
+                || difftime(now, last[i]) < interval)
+                continue;
+            last[i] = now;
+            command = config_get(config, server->id, "tps_command", "tps");
+            snprintf(msg, sizeof(msg), "%s\n", command);
+            server_send(server, msg);
+        }
+    }
+}
@@ -0,0 +1,46 @@
+//
+//  telemetry.h
+//  mcmdd
+//
+//  Game performance samples parsed from the console.
+//
+
+#ifndef mcmdd_telemetry_h
+#define mcmdd_telemetry_h
+
+#include <pthread.h>
+
+#include "server.h"
+
+#define TELEMETRY_SAMPLES 512
+
+enum metric_t {
+    METRIC_LAG_MS = 0,
+    METRIC_LAG_TICKS,
+    METRIC_TPS,
+    METRIC_GC_MS,
+    METRIC_COUNT
+};
+
+struct series_t {
+    double values[TELEMETRY_SAMPLES];
+    time_t times[TELEMETRY_SAMPLES];
+    int sp, len;
+};
+
+struct telemetry_t {
+    pthread_mutex_t lock;
+    struct series_t series[METRIC_COUNT];
+    // last reported player count, -1 when unknown, when it was reported
+    // and when it was last above zero
+    volatile int players;
+    time_t players_at, last_players;
+};
+
+struct telemetry_t *telemetry_new(void);
+void telemetry_sample(struct server_t *server, const char *metric, const char *line);
+void telemetry_report(struct server_t *server, int fd);
+void telemetry_free(struct telemetry_t *telemetry);
+void *telemetry_monitor(void *ptr);
+
+#endif
@@ -0,0 +1,129 @@
+//
+//  status.c
+//  mcmdd
+//
+//  Prints the state of every server from mcmdd's status page, once or
+//  every few seconds, without connecting to the daemon.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+
+#include "server.h"
+#include "statpage.h"
+
+static const char *status_names[] = { "stopped", "starting", "running", "stopping", "backup" };
+static const char *ctrl_names[] = { "clean", "exit", "launch", "pause" };
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-f status page] [-w seconds] [server]...\n"
+            "  -f  the status_page file of mcmdd (default mcmdd.status)\n"
+            "  -w  print again every so many seconds\n", name);
+    exit(1);
+}
+
+static const char *name_of(const char **names, int count, int value)
+{
+    return value >= 0 && value < count ? names[value] : "?";
+}
+
+// seconds since a unix time as "3d4h", "5h12m", "7m3s" or "-" for never
+static const char *ago(char *buf, size_t size, time_t now, time_t then)
+{
+    long s = now - then;
+    if (then <= 0)
+        snprintf(buf, size, "-");
+    else if (s >= 86400)
+        snprintf(buf, size, "%ldd%ldh", s / 86400, s % 86400 / 3600);
+    else if (s >= 3600)
+        snprintf(buf, size, "%ldh%ldm", s / 3600, s % 3600 / 60);
+    else if (s >= 60)
+        snprintf(buf, size, "%ldm%lds", s / 60, s % 60);
+    else
+        snprintf(buf, size, "%lds", s < 0 ? 0 : s);
+    return buf;
+}
+
+static void print_record(const struct statpage_record_t *record, time_t now)
+{
+    char up[32], idle[32], backup[32];
+
+    // uptime only means something while the process is there
+    if (record->status == STATUS_STARTING || record->status == STATUS_RUNNING
+        || record->status == STATUS_STOPPING)
+        ago(up, sizeof(up), now, record->start);
+    else
+        snprintf(up, sizeof(up), "-");
+    printf("%-16s %-8s %-6s %7d %8s %6u %5d %8s %10llu %8s\n", record->id,
+           name_of(status_names, 5, record->status), name_of(ctrl_names, 4, record->ctrl),
+           record->pid, up, record->starts, record->failures,
+           ago(idle, sizeof(idle), now, record->last_read), (unsigned long long) record->lines,
+           record->backup ? "running" : ago(backup, sizeof(backup), now, record->last_backup));
+}
+
+static int print_page(const struct statpage_t *page, char **ids, int nids)
+{
+    struct statpage_record_t record;
+    time_t now = time(NULL);
+    int i, index, missing = 0;
+
+    printf("%-16s %-8s %-6s %7s %8s %6s %5s %8s %10s %8s\n", "SERVER", "STATUS", "CTRL", "PID",
+           "UP", "STARTS", "FAILS", "IDLE", "LINES", "BACKUP");
+    if (nids == 0) {
+        for (i = 0; statpage_read(page, i, &record) == 0; ++i)
+            print_record(&record, now);
+        return 0;
+    }
+    for (i = 0; i < nids; ++i) {
+        index = statpage_find(page, ids[i]);
+        if (index < 0 || statpage_read(page, index, &record) < 0) {
+            warnx("No server %s", ids[i]);
+            missing = 1;
+            continue;
+        }
+        print_record(&record, now);
+    }
+    return missing;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "mcmdd.status";
+    struct statpage_t *page;
+    int c, interval = 0, rc;
+
+    while ((c = getopt(argc, argv, "f:w:h")) != -1) {
+        switch (c) {
+            case 'f': path = optarg; break;
+            case 'w': interval = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    page = statpage_open(path);
+    if (!page)
+        errx(1, "No status page at %s, is status_page set in mcmdd.conf?", path);
+    for (;;) {
+        rc = print_page(page, argv + optind, argc - optind);
+        if (interval <= 0)
+            break;
+        fflush(stdout);
+        sleep(interval);
+        // the daemon exited or handed over, its successor makes a new page
+        if (statpage_closed(page)) {
+            statpage_close(page);
+            while (!(page = statpage_open(path)) || statpage_closed(page)) {
+                if (page)
+                    statpage_close(page);
+                sleep(1);
+            }
+        }
+        printf("\n");
+    }
+    statpage_close(page);
+    return rc ? 2 : 0;
+}
@@ -0,0 +1,266 @@
+//
+//  trace.c
+//  mcmdd
+//
+//  Every control command, and the stop, start and backup of a server, is
+//  timed and counted into a histogram named after it. Buckets are linear
+//  within each power of two, like HDR histograms, so percentiles are
+//  within about 6% at any scale, and recording is a few atomic adds with
+//  no lock. When trace_events is set, the most recent spans are also kept
+//  in a ring that TRACE can list or export for chrome://tracing.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "trace.h"
+
+static struct trace_metric_t metrics[TRACE_METRICS];
+static int nmetrics;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct trace_event_t *ring;
+static unsigned long ring_head;
+static int ring_len;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int thread_id(void)
+{
+#ifdef __linux__
+    return syscall(SYS_gettid);
+#else
+    // only needs to tell the threads in a trace apart
+    return (int) (intptr_t) pthread_self();
+#endif
+}
+
+long long trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*!
+ * @param events how many recent events to keep, 0 for none
+ */
+void trace_init(int events)
+{
+    if (events <= 0)
+        return;
+    ring = calloc(events, sizeof(struct trace_event_t));
+    if (!ring)
+        err(1, "Failed to allocate memory");
+    ring_len = events;
+}
+
+static inline int bucket(long long value)
+{
+    int e;
+    if (value < 16)
+        return value < 0 ? 0 : value;
+    e = 63 - __builtin_clzll(value);
+    return (e - 3) * 16 + ((value >> (e - 4)) & 15);
+}
+
+// highest value that falls into the bucket
+static inline long long bucket_value(int index)
+{
+    int e;
+    if (index < 16)
+        return index;
+    e = index / 16 + 3;
+    return ((16LL + index % 16 + 1) << (e - 4)) - 1;
+}
+
+static struct trace_metric_t *find_metric(const char *name)
+{
+    int i, n;
+
+    n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; ++i)
+        if (metrics[i].name == name || strcmp(metrics[i].name, name) == 0)
+            return &metrics[i];
+    pthread_mutex_lock(&metrics_lock);
+    for (; i < nmetrics; ++i)
+        if (strcmp(metrics[i].name, name) == 0)
+            break;
+    if (i == nmetrics && nmetrics < TRACE_METRICS) {
+        metrics[i].name = name;
+        __atomic_store_n(&nmetrics, nmetrics + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    return i < TRACE_METRICS ? &metrics[i] : NULL;
+}
+
+/*!
+ * Counts the time since begin (from trace_now) under name, which must
+ * stay valid for the life of the daemon.
+ */
+void trace_record(const char *name, const char *server, long long begin)
+{
+    struct trace_metric_t *metric;
+    struct trace_event_t *event;
+    long long end, duration, max;
+
+    end = trace_now();
+    duration = end - begin;
+    metric = find_metric(name);
+    if (metric) {
+        __atomic_fetch_add(&metric->counts[bucket(duration)], 1, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&metric->max, __ATOMIC_RELAXED);
+        while (duration > max && !__atomic_compare_exchange_n(&metric->max, &max, duration, 1,
+                                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+    if (ring) {
+        pthread_mutex_lock(&ring_lock);
+        event = &ring[ring_head++ % ring_len];
+        event->begin = begin;
+        event->duration = duration;
+        event->name = name;
+        event->server = server;
+        event->tid = thread_id();
+        pthread_mutex_unlock(&ring_lock);
+    }
+}
+
+static double percentile(const unsigned long *counts, unsigned long total, double p)
+{
+    unsigned long rank, seen;
+    int i;
+
+    rank = (unsigned long) (p * total + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    for (seen = 0, i = 0; i < TRACE_BUCKETS; ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            return bucket_value(i) / 1000.0;
+    }
+    return 0;
+}
+
+/*!
+ * One line per metric: name, count, then p50, p90, p99, p99.9 and max in
+ * microseconds.
+ */
+void trace_report(int fd)
+{
+    unsigned long counts[TRACE_BUCKETS], total;
+    char msg[256];
+    int i, n, b;
+
+    n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; ++i) {
+        for (total = 0, b = 0; b < TRACE_BUCKETS; ++b) {
+            counts[b] = __atomic_load_n(&metrics[i].counts[b], __ATOMIC_RELAXED);
+            total += counts[b];
+        }
+        if (total == 0) {
+            snprintf(msg, sizeof(msg), "%s 0\n", metrics[i].name);
+        } else {
+            snprintf(msg, sizeof(msg), "%s %lu %.1f %.1f %.1f %.1f %.1f\n", metrics[i].name, total,
+                     percentile(counts, total, 0.5), percentile(counts, total, 0.9),
+                     percentile(counts, total, 0.99), percentile(counts, total, 0.999),
+                     metrics[i].max / 1000.0);
+        }
+        write(fd, msg, strlen(msg));
+    }
+}
+
+// copies the ring out oldest first, returns how many events there are
+static int snapshot(struct trace_event_t **out)
+{
+    unsigned long first, i;
+    int n;
+
+    *out = NULL;
+    if (!ring)
+        return 0;
+    *out = malloc(ring_len * sizeof(struct trace_event_t));
+    if (!*out)
+        err(1, "Failed to allocate memory");
+    pthread_mutex_lock(&ring_lock);
+    first = ring_head > (unsigned long) ring_len ? ring_head - ring_len : 0;
+    for (n = 0, i = first; i < ring_head; ++i)
+        (*out)[n++] = ring[i % ring_len];
+    pthread_mutex_unlock(&ring_lock);
+    return n;
+}
+
+/*!
+ * One line per recent event: start and duration in microseconds, thread,
+ * name, and the server if there was one.
+ */
+void trace_events(int fd)
+{
+    struct trace_event_t *events;
+    char msg[256];
+    int i, n;
+
+    n = snapshot(&events);
+    for (i = 0; i < n; ++i) {
+        snprintf(msg, sizeof(msg), "%.3f %.3f %d %s %s\n", events[i].begin / 1000.0,
+                 events[i].duration / 1000.0, events[i].tid, events[i].name,
+                 events[i].server ? events[i].server : "-");
+        write(fd, msg, strlen(msg));
+    }
+    free(events);
+}
+
+/*!
+ * The recent events as complete ("X") events in the Chrome trace format,
+ * one per line so the reply stays line based.
+ */
+void trace_json(int fd)
+{
+    struct trace_event_t *events;
+    char msg[512], server[128];
+    const char *c;
+    int i, n, len;
+
+    n = snapshot(&events);
+    snprintf(msg, sizeof(msg), "{\"traceEvents\":[\n");
+    write(fd, msg, strlen(msg));
+    for (i = 0; i < n; ++i) {
+        // server ids come from the config, escape what JSON can't hold
+        for (len = 0, c = events[i].server ? events[i].server : ""; *c && len < sizeof(server) - 7; ++c) {
+            if (*c == '"' || *c == '\\' || (unsigned char) *c < 0x20)
+                len += snprintf(server + len, sizeof(server) - len, "\\u%04x", (unsigned char) *c);
+            else
+                server[len++] = *c;
+        }
+        server[len] = '\0';
+        snprintf(msg, sizeof(msg), "{\"name\":\"%s\",\"cat\":\"mcmdd\",\"ph\":\"X\",\"ts\":%.3f,"
+                 "\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"server\":\"%s\"}}%s\n",
+                 events[i].name, events[i].begin / 1000.0, events[i].duration / 1000.0,
+                 (int) getpid(), events[i].tid, server, i + 1 < n ? "," : "");
+        write(fd, msg, strlen(msg));
+    }
+    snprintf(msg, sizeof(msg), "]}\n");
+    write(fd, msg, strlen(msg));
+    free(events);
+}
+
+void trace_reset(void)
+{
+    int i, n;
+
+    n = __atomic_load_n(&nmetrics, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; ++i) {
+        memset(metrics[i].counts, 0, sizeof(metrics[i].counts));
+        metrics[i].max = 0;
+    }
+    pthread_mutex_lock(&ring_lock);
+    ring_head = 0;
+    pthread_mutex_unlock(&ring_lock);
+}
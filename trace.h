@@ -0,0 +1,40 @@
+//
+//  trace.h
+//  mcmdd
+//
+//  Latency histograms for control commands and server phases, and an
+//  optional ring of recent events.
+//
+
+#ifndef mcmdd_trace_h
+#define mcmdd_trace_h
+
+#include <pthread.h>
+
+#define TRACE_METRICS 48
+// 16 linear buckets per power of two, enough for any 63 bit value
+#define TRACE_BUCKETS 976
+
+struct trace_metric_t {
+    const char *name;
+    unsigned long counts[TRACE_BUCKETS];
+    long long max;
+};
+
+struct trace_event_t {
+    // nanoseconds on the monotonic clock
+    long long begin, duration;
+    const char *name;
+    const char *server;
+    int tid;
+};
+
+long long trace_now(void);
+void trace_init(int events);
+void trace_record(const char *name, const char *server, long long begin);
+void trace_report(int fd);
+void trace_events(int fd);
+void trace_json(int fd);
+void trace_reset(void);
+
+#endif
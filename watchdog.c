@@ -0,0 +1,204 @@
+//
+//  watchdog.c
+//  mcmdd
+//
+//  A running server is probed with a cheap console command and has to
+//  print something within its deadline, or, without a probe command, its
+//  CPU time has to keep advancing. A hung server gets a thread dump
+//  (SIGQUIT), its console history is saved to WATCHDOG_DIRECTORY and it
+//  is stopped, killed if need be, and restarted.
+//
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <err.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "watchdog.h"
+
+// how long a restarted server may take to come back before we stop timing it
+#define RECOVERY_WAIT 600
+
+extern struct server_t **servers;
+extern int servers_sp;
+
+void watchdog_init(struct server_t *server, int deadline, const char *probe)
+{
+    struct watchdog_t *wd = calloc(1, sizeof(struct watchdog_t));
+    if (!wd)
+        err(1, "Failed to allocate memory");
+    wd->deadline = deadline;
+    if (probe && probe[0]) {
+        wd->probe = malloc(strlen(probe) + 2);
+        if (!wd->probe)
+            err(1, "Failed to allocate memory");
+        sprintf(wd->probe, "%s\n", probe);
+    }
+    wd->last_detection = -1;
+    wd->last_recovery = -1;
+    server->watchdog = wd;
+}
+
+void watchdog_free(struct server_t *server)
+{
+    if (!server->watchdog)
+        return;
+    free(server->watchdog->probe);
+    free(server->watchdog);
+    server->watchdog = NULL;
+}
+
+/*!
+ * @return user plus system time of the process in clock ticks, or 0 if it
+ *   can't be read
+ */
+static unsigned long long cpu_time(pid_t pid)
+{
+#ifdef __linux__
+    char path[64], buf[1024], *p;
+    unsigned long long utime, stime;
+    FILE *file;
+    size_t len;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    file = fopen(path, "r");
+    if (!file)
+        return 0;
+    len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+    // the command name may contain spaces, so skip past its parentheses
+    p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                     &utime, &stime) != 2)
+        return 0;
+    return utime + stime;
+#else
+    return 0;
+#endif
+}
+
+static void save_log(struct server_t *server)
+{
+    char path[256], date[64];
+    time_t now;
+    FILE *file;
+
+    if (access(WATCHDOG_DIRECTORY, F_OK) == -1 && mkdir(WATCHDOG_DIRECTORY, 0777) < 0) {
+        warn("Failed to create watchdog directory");
+        return;
+    }
+    time(&now);
+    strftime(date, sizeof(date), BACKUP_DATE, localtime(&now));
+    snprintf(path, sizeof(path), WATCHDOG_DIRECTORY "/%s-%s.log", server->id, date);
+    file = fopen(path, "w");
+    if (!file) {
+        warn("Failed to save log of hung server %s", server->id);
+        return;
+    }
+    server_dump_log(server, file);
+    fclose(file);
+    printf("[%s] Saved console history to %s.\n", server->id, path);
+}
+
+static void *recover(void *ptr)
+{
+    struct server_t *server = ptr;
+    struct watchdog_t *wd = server->watchdog;
+    time_t detected, now;
+
+    time(&detected);
+    printf("[%s] Not responding for %d seconds, restarting.\n", server->id, wd->last_detection);
+    server_note(server, "Watchdog: server not responding");
+    // the JVM prints a thread dump to stdout, which ends up in the history
+    kill(server->pid, SIGQUIT);
+    sleep(2);
+    save_log(server);
+    server_stop_kill(server, EXIT_RESTART, wd->deadline);
+    // time until the server is back, unless it was paused or shut down
+    do {
+        sleep(1);
+        time(&now);
+    } while (server->status != STATUS_RUNNING && server->ctrl != CTRL_PAUSE
+             && server->ctrl != CTRL_EXIT && difftime(now, detected) < RECOVERY_WAIT);
+    if (server->status == STATUS_RUNNING) {
+        wd->last_recovery = (int) difftime(now, detected);
+        printf("[%s] Recovered %d seconds after hang detection.\n", server->id, wd->last_recovery);
+    }
+    wd->outstanding = 0;
+    wd->recovering = 0;
+    return NULL;
+}
+
+static int check(struct server_t *server, time_t now)
+{
+    struct watchdog_t *wd = server->watchdog;
+    unsigned long long cpu;
+
+    if (wd->probe) {
+        if (wd->outstanding && server->lines != wd->probe_lines)
+            wd->outstanding = 0;
+        if (!wd->outstanding && difftime(now, wd->probe_sent) >= wd->deadline) {
+            time(&wd->probe_sent);
+            wd->outstanding = 1;
+            // before sending, as the answer can be in before server_send() returns
+            wd->probe_lines = server->lines;
+            server_send(server, wd->probe);
+        } else if (wd->outstanding && difftime(now, wd->probe_sent) >= wd->deadline) {
+            wd->last_detection = (int) difftime(now, server->last_read);
+            return 1;
+        }
+        return 0;
+    }
+    cpu = cpu_time(server->pid);
+    if (cpu == 0)
+        return 0;
+    if (cpu != wd->cpu || wd->cpu_changed < server->start) {
+        wd->cpu = cpu;
+        wd->cpu_changed = now;
+        return 0;
+    }
+    if (difftime(now, wd->cpu_changed) >= wd->deadline) {
+        wd->last_detection = (int) difftime(now, wd->cpu_changed);
+        return 1;
+    }
+    return 0;
+}
+
+void *watchdog_monitor(void *ptr)
+{
+    size_t i;
+    time_t now;
+    pthread_t thread;
+
+    while (1) {
+        sleep(1);
+        time(&now);
+        for (i = 0; i < servers_sp; ++i) {
+            struct server_t *server = servers[i];
+            struct watchdog_t *wd = server->watchdog;
+            if (!wd || wd->recovering)
+                continue;
+            if (server->status != STATUS_RUNNING) {
+                wd->outstanding = 0;
+                continue;
+            }
+            if (!check(server, now))
+                continue;
+            wd->hangs++;
+            wd->recovering = 1;
+            // recovery waits on the server, keep watching the others meanwhile
+            if (pthread_create(&thread, NULL, recover, server) != 0) {
+                warn("pthread_create for recovery of %s", server->id);
+                wd->recovering = 0;
+                continue;
+            }
+            pthread_detach(thread);
+        }
+    }
+}
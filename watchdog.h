@@ -0,0 +1,35 @@
+//
+//  watchdog.h
+//  mcmdd
+//
+//  Detects and restarts servers that stopped responding.
+//
+
+#ifndef mcmdd_watchdog_h
+#define mcmdd_watchdog_h
+
+#include "server.h"
+
+struct watchdog_t {
+    // seconds a server may stay silent before it is considered hung
+    int deadline;
+    // console command expected to produce output, NULL to watch CPU time
+    char *probe;
+    time_t probe_sent;
+    // lines read before the probe was sent, any later line answers it
+    unsigned long probe_lines;
+    int outstanding;
+    unsigned long long cpu;
+    time_t cpu_changed;
+    volatile int recovering;
+    int hangs;
+    // seconds from the last sign of life to detection, and from
+    // detection to running again, -1 until known
+    int last_detection, last_recovery;
+};
+
+void watchdog_init(struct server_t *server, int deadline, const char *probe);
+void watchdog_free(struct server_t *server);
+void *watchdog_monitor(void *ptr);
+
+#endif